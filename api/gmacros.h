@@ -2,6 +2,8 @@
 #ifndef GMACROS_H
 #define GMACROS_H
 
+#include <stddef.h>
+
 #ifdef __GNUC__
 #define GM_API __attribute__((visibility("default")))
 #else
@@ -10,35 +12,204 @@
 
 typedef void* gm_handle; /* opaque library handle type */
 typedef void* gm_latch; /* opaque latch type        */
+typedef struct gmi_sequence* gm_sequence; /* compiled action sequence, see gm_sequence_compile */
+
+/*
+  What happens when a macro is triggered while an earlier invocation of it has
+  not finished yet (it is sleeping or waiting on a latch):
+*/
+#define GM_POLICY_DROP     0 /* ignore the new trigger (default)                          */
+#define GM_POLICY_QUEUE    1 /* run it after the current invocation, in trigger order;
+                                at most 'limit' triggers are kept waiting                 */
+#define GM_POLICY_RESTART  2 /* discard the running invocation and start over. The old
+                                handler is abandoned where it was suspended, so it must
+                                not hold resources across sleeps or waits. Lua handlers
+                                run in coroutine mode for this                           */
+#define GM_POLICY_PARALLEL 3 /* run up to 'limit' invocations side by side                */
 
 typedef struct {
     void* arg;                   /* user argument    */
     void (*f)(int value, void*); /* handler function (value: 0 release, 1 press, 2 repeat) */
     
     const char* key;  /*
-                        single, null terminated character in the system
-                        encoding, or a special character (DEL, INS, etc)
+                        trigger, using evdev key names (A, ESC, LEFTCTRL, KP1, ...):
+                          "X"                    single key, value follows the key
+                          "LEFTCTRL+LEFTSHIFT+X" chord: 1 once all keys are held (in any
+                                                 order), 2 on repeat, 0 when one is released
+                          "Q,W,E"                sequence: called with 1 when the keys are
+                                                 pressed in order, each within the handle's
+                          "Q,W,E/150"            sequence_window or the given milliseconds
+                        Any other key pressed in between starts a sequence over.
                       */
-                     
+    
+    size_t stack_size; /* coroutine stack size in bytes, 0 for the handle's default */
+    
+    int policy;         /* GM_POLICY_XXX, what to do with triggers while the macro runs */
+    unsigned int limit; /* queue depth or parallel instances, 0 for the handle's default */
+    
+    const char* device; /* only trigger on this device (path as passed to gm_device_add, or
+                           just its last component), NULL for any of the handle's devices */
+    
+    gm_sequence sequence; /* run this on press instead of calling f (which may be NULL) */
+    
+    /*
+      Stackless handler, used instead of f: called on the scheduler thread without a
+      coroutine, first with *state NULL and again after each gmh_sleep, gmh_sleep_us or
+      gmh_wait, which only schedule that call and return. Return non-zero right after
+      them to be resumed, zero when done. discard (may be NULL) is called instead of
+      resuming an invocation that GM_POLICY_RESTART abandons.
+    */
+    int (*step)(int value, void* arg, void** state);
+    void (*discard)(void* arg, void* state);
 } gm_macro;
 
+/*
+  One step of an action sequence. Sequences are straight lists of output and sleeps that
+  the scheduler interprets directly, without a coroutine (stack or context switch) per run.
+*/
+#define GM_STEP_KEY     0 /* key, press                                   */
+#define GM_STEP_BUTTON  1 /* button, press                                */
+#define GM_STEP_MOVE    2 /* x, y                                         */
+#define GM_STEP_SLEEP   3 /* us                                           */
+#define GM_STEP_SAVE    4 /* remember the pointer position (gmh_getmouse) */
+#define GM_STEP_RESTORE 5 /* move back to the remembered position         */
+
+typedef struct {
+    int op;          /* GM_STEP_XXX                                      */
+    int press;       /* key and button: 1 press, 0 release, 2 both (tap) */
+    const char* key;
+    unsigned int button;
+    int x, y;
+    long us;
+} gm_step;
+
 typedef struct {
     long sched_intval; /* Maximum scheduler interval (ms) in which the scheduler must check for
                           pending events. Does not effect gm_sleep call accuracy or initial macro
-                          response time (due to calculated thread sleep times and broadcasts). */
+                          response time (due to calculated thread sleep times and broadcasts).
+                          Unused by the timerfd scheduler, which never polls. */
+    int sched_timerfd; /* Non-zero to run the scheduler on a timerfd/eventfd epoll loop with
+                          absolute CLOCK_MONOTONIC deadlines (microsecond wakeup precision).
+                          Zero uses a condition variable with timed waits instead. */
+    long sched_workers; /* Number of scheduler threads. Each has its own timers and output
+                           connection (a uinput device each with GM_OUTPUT_UINPUT), and a
+                           macro invocation stays on the one that started it. New triggers
+                           queue on their macro's worker, and idle workers take those that a
+                           busy one has not started yet. Lua handlers still run one at a time */
+    long pool_size;    /* Number of objects preallocated for each internal object pool (scheduler
+                          events, macro invocations and gm_sched tasks). Objects allocated past
+                          that are recycled while the pool holds fewer than this many free
+                          objects, and handed back to malloc otherwise. */
+    long stack_size;   /* Default coroutine stack size (bytes), 0 for 1 MiB. Stacks are mmap'd
+                          with a guard page, and pages are only faulted in when a handler
+                          touches them. */
+    long stack_cache;  /* Number of unused stacks kept mapped for reuse by later invocations,
+                          0 for the default (8) and negative to keep none */
+    int stack_debug;   /* Non-zero to fill stacks with a pattern and report each macro's
+                          stack high-water mark on stderr whenever it grows */
+    long instance_limit; /* Default 'limit' (0 for 8) for macros using GM_POLICY_QUEUE or
+                            GM_POLICY_PARALLEL */
+    long sequence_window; /* Default time (ms) allowed between the keys of a sequence trigger,
+                             0 for 300 */
+    int output;        /* GM_OUTPUT_XXX, how simulated input is delivered */
+    long pointer_track; /* Non-zero to answer gmh_getmouse from a tracked position instead of
+                           an X round-trip. The position is set by gmh_move and each real
+                           query, and follows REL_X/REL_Y motion of the handle's devices (so
+                           add the mouse, and mind that X pointer acceleration is not
+                           applied). A real query is made when there is no position yet, and
+                           once the last one is older than this many ms (negative: never). */
+    int output_coalesce; /* Non-zero to buffer injected events and flush them once per scheduler
+                            cycle and whenever a handler sleeps or waits, instead of after every
+                            event. gmh_flush(h, 0) still holds all flushing back until
+                            gmh_flush(h, 1). */
 } gm_settings;
 
+#define GM_OUTPUT_XTEST  0 /* XTest requests on the X connection (default)                     */
+#define GM_OUTPUT_UINPUT 1 /* a /dev/uinput virtual device, one write() per flush. Keys use evdev
+                              names (X keysym names of common keys are translated), and X is
+                              optional: without a display gmh_getmouse reports the last move */
+#define GM_OUTPUT_XCB    2 /* XTest over a separate XCB connection. Never waits on the server:
+                              gmh_getmouse suspends the handler until the reply is in (with the
+                              timerfd scheduler). Needs a library built with XCB=true */
+
 extern const gm_settings gm_default_settings; /* default settings */
 
+typedef struct {
+    unsigned long used;   /* objects currently in use                  */
+    unsigned long free;   /* objects cached for reuse                  */
+    unsigned long peak;   /* highest number of objects in use at once  */
+    unsigned long misses; /* allocations that had to fall back to malloc */
+} gm_pool_stats;
+
+typedef struct {
+    unsigned long count; /* samples                                      */
+    unsigned long p50;   /* nanoseconds, upper bound of the histogram    */
+    unsigned long p99;   /* bucket (within 1/8 of the true value)        */
+    unsigned long max;   /* nanoseconds, exact                           */
+} gm_latency;
+
+typedef struct {
+    gm_pool_stats events;   /* scheduler events                  */
+    gm_pool_stats routines; /* macro invocations and gm_sched tasks */
+    gm_pool_stats stacks;   /* coroutine stacks (in use includes the
+                               scheduler's spare stack)           */
+    unsigned long stack_hwm; /* deepest stack use seen, bytes (stack_debug only) */
+    
+    unsigned long policy_dropped;   /* triggers ignored (GM_POLICY_DROP, full queue or limit) */
+    unsigned long policy_queued;    /* triggers deferred by GM_POLICY_QUEUE                   */
+    unsigned long policy_restarted; /* invocations discarded by GM_POLICY_RESTART             */
+    unsigned long policy_parallel;  /* invocations started next to a running one              */
+    
+    unsigned long pointer_tracked;  /* gmh_getmouse calls answered by the pointer tracker     */
+    unsigned long pointer_queried;  /* gmh_getmouse calls that queried the output backend     */
+    
+    unsigned long output_events;    /* injected events flushed to the output backend          */
+    unsigned long output_flushes;   /* flushes, output_events / output_flushes per batch      */
+    
+    unsigned long sched_stolen;     /* routines started by a worker other than the one they
+                                       were queued on (gm_settings.sched_workers)             */
+    
+    /*
+      latency of finished macro invocations per stage, on CLOCK_MONOTONIC. Stages
+      starting at the evdev timestamp are only measured for devices that accept
+      EVIOCSCLOCKID; output stages only for invocations that flushed output to X.
+    */
+    gm_latency lat_kernel;   /* evdev timestamp -> read by the listener       */
+    gm_latency lat_listener; /* listener read -> handed to the scheduler      */
+    gm_latency lat_queue;    /* scheduler queue (and GM_POLICY_QUEUE) wait    */
+    gm_latency lat_output;   /* handler start -> first output flushed         */
+    gm_latency lat_total;    /* evdev timestamp -> first output flushed       */
+    gm_latency lat_handler;  /* time spent running the handler, excluding
+                                sleeps and waits                             */
+} gm_statistics;
+
+typedef struct {
+    unsigned long invocations;    /* handler invocations started               */
+    unsigned long dropped;        /* triggers ignored by the invocation policy */
+    unsigned long long handler_ns; /* total time spent running the handler     */
+} gm_macro_statistics;
+
 
 /*
   Initialize the library with the provided device from /dev/input. An example of
   valid input (for a specific system) is shown below:
   
   h = gm_init("/dev/input/by-path/pci-0000:00:1d.0-usb-0:1.6.3:1.0-event-kbd", NULL);
+  
+  devpath may be NULL, more devices can be added with gm_device_add.
 */
 GM_API gm_handle gm_init  (const char* devpath, const gm_settings* settings);
 
+/*
+  Watch another input device. All devices share one listener thread. A device that is
+  missing or gets unplugged stays registered and is (re)opened when its name appears in
+  its directory again, so stable /dev/input/by-id paths survive replugging.
+  Returns 0 on success, 1 if the path was already added and 2 if it could not be opened
+  (a missing device included, when its directory cannot be watched).
+*/
+GM_API int       gm_device_add    (gm_handle h, const char* path);
+GM_API int       gm_device_remove (gm_handle h, const char* path); /* returns 1 if not found */
+
 GM_API void      gm_close (gm_handle h); /* close handle */
 
 GM_API void      gm_start (gm_handle h); /* start listening for any registered macros */
@@ -55,26 +226,59 @@ GM_API void      gm_stop  (gm_handle h); /* stop listening for any registered ma
                                                         --
       .key = "a"                                        -- key that should trigger the handler
   };
+  
+  .stack_size, .policy and .limit may be left zero for the defaults.
 */
 GM_API int gm_register       (gm_handle h, gm_macro* macro); /* register macro (returns non-zero for error) */
+/* both return 2 while listening, or while an invocation (even a restarted one) is not freed yet */
 GM_API int gm_unregister     (gm_handle h, gm_macro* macro); /* unregister an existing macro                */
 GM_API int gm_unregister_all (gm_handle h);                  /* unregister all macros for this handle       */
 
 /* safely execute handler commands (through the scheduler) without a key binding */
 GM_API void gm_sched (gm_handle h, void (*f)(void* d), void* d);
 
+/*
+  compile n steps for use with this handle (keys are resolved through gm_key_resolve).
+  Returns NULL for an invalid step. A sequence must stay alive while it is registered;
+  freeing one that is still running (gm_sequence_run, or a restarted or unregistered
+  macro) leaves it to the last invocation.
+*/
+GM_API gm_sequence gm_sequence_compile (gm_handle h, const gm_step* steps, size_t n);
+GM_API void        gm_sequence_free    (gm_sequence s);
+GM_API void        gm_sequence_run     (gm_handle h, gm_sequence s); /* run once, like gm_sched */
+
+/* evdev key name (as accepted for gm_macro.key) for a keycode, NULL if it has none */
+GM_API const char* gm_key_name (unsigned int code);
+
+/* store a snapshot of the handle's internal counters */
+GM_API void gm_stats (gm_handle h, gm_statistics* s);
+
+/* store a snapshot of a registered macro's counters, returns 1 if it is not registered */
+GM_API int  gm_macro_stats (gm_handle h, const gm_macro* macro, gm_macro_statistics* s);
+
 /* below functions to be executed in the handler */
 
+/*
+  id for a key name as accepted by gmh_key, to be pressed with gmh_key_code without any
+  string handling. Safe to call from anywhere (typically once, when registering macros);
+  ids stay valid for the handle's lifetime and follow keyboard mapping changes. gmh_key
+  goes through the same per-handle cache. Returns -1 past 65536 distinct names.
+*/
+GM_API int  gm_key_resolve (gm_handle h, const char* key);
+
 GM_API void gmh_key      (gm_handle h, int press, const char* key);         /* simulate key            */
+GM_API void gmh_key_code (gm_handle h, int press, int key);                 /* simulate gm_key_resolve'd key */
 GM_API void gmh_mouse    (gm_handle h, int press, unsigned int button);     /* simulate mouse button   */
 GM_API void gmh_move     (gm_handle h, int x, int y);                       /* simulate mouse move     */
 GM_API void gmh_getmouse (gm_handle h, int* x, int* y);                     /* store mouse position    */
 
 GM_API void gmh_sleep    (gm_handle h, int ms);                             /* sleep for milliseconds  */
+GM_API void gmh_sleep_us (gm_handle h, long us);                            /* sleep for microseconds  */
 GM_API void gmh_wait     (gm_handle h, gm_latch l);                         /* wait until open         */
 
 GM_API void gmh_flush    (gm_handle h, int toggle);                         /* toggle flushing, performs
-                                                                               a flush when toggled on  */
+                                                                               a flush when toggled on
+                                                                               (see output_coalesce)    */
 
 /*
   latch functions -- latches can be created and destroyed from anywhere, but should
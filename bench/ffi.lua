@@ -0,0 +1,33 @@
+--[[
+  Key injection call overhead: gm.key through the classic binding (by name, and by a
+  gm.keycode id) against gmh_key_code called through the LuaJIT FFI. The key has no
+  keycode, so nothing reaches X and only the path into the library is measured. Run by
+  "make bench" with BENCH_LUA (luajit for LUAJIT=true builds).
+]]
+
+package.loadlib("./libgmacros.so", "gm_lua")()
+gm.init(nil)
+
+local N = 10000000
+local name = "GM_BENCH_UNMAPPED"
+local id = gm.keycode(name) -- opaque, see gm_key_resolve through the FFI below
+
+local function bench(label, f)
+    f(N / 100) -- warm up (and let LuaJIT compile the loop)
+    local t = os.clock()
+    f(N)
+    t = os.clock() - t
+    print(string.format("%-24s %7.1f ns/call", label, t * 1e9 / N))
+end
+
+bench("gm.key (name)", function(n) for i = 1, n do gm.key(true, name) end end)
+bench("gm.key (keycode)", function(n) for i = 1, n do gm.key(true, id) end end)
+
+if jit then
+    local gmffi = require("gmacros_ffi")
+    local C, h = gmffi.load(), gmffi.handle()
+    local code = C.gm_key_resolve(h, name)
+    bench("C.gmh_key_code (FFI)", function(n) for i = 1, n do C.gmh_key_code(h, 1, code) end end)
+else
+    print("not LuaJIT (" .. _VERSION .. "), skipping the FFI path")
+end
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <ucontext.h>
+
+#include <context.h> /* generated by iheaders from src/context.c */
+
+/*
+  Context switch microbenchmark: ping-pong between the main context and a
+  coroutine, comparing swapcontext (what gmh_sleep used to cost) against
+  gmi_ctx_switch. Each iteration is two switches.
+*/
+
+#define ITERATIONS 2000000
+#define STACK_SIZE (64 * 1024)
+
+static ucontext_t uc_main, uc_co;
+static gmi_ctx    gc_main, gc_co;
+
+static uint64_t now(void) {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return ((uint64_t) tm.tv_sec * 1000000000ULL) + (uint64_t) tm.tv_nsec;
+}
+
+static void uc_entry(void) {
+    for (;;) swapcontext(&uc_co, &uc_main);
+}
+
+static void gc_entry(void* ignored) {
+    for (;;) gmi_ctx_switch(&gc_co, &gc_main);
+}
+
+int main(int argc, char** argv) {
+    void* stack = malloc(STACK_SIZE);
+    size_t t;
+    
+    getcontext(&uc_co);
+    uc_co.uc_link = NULL;
+    uc_co.uc_stack = (stack_t) { .ss_sp = stack, .ss_size = STACK_SIZE };
+    makecontext(&uc_co, uc_entry, 0);
+    
+    uint64_t start = now();
+    for (t = 0; t < ITERATIONS; ++t)
+        swapcontext(&uc_main, &uc_co);
+    uint64_t uc_ns = now() - start;
+    
+    gmi_ctx_make(&gc_co, stack, STACK_SIZE, &gc_entry, NULL);
+    
+    start = now();
+    for (t = 0; t < ITERATIONS; ++t)
+        gmi_ctx_switch(&gc_main, &gc_co);
+    uint64_t gc_ns = now() - start;
+    
+    printf("swapcontext:    %6.1f ns/switch\n", (double) uc_ns / (ITERATIONS * 2));
+    printf("gmi_ctx_switch: %6.1f ns/switch\n", (double) gc_ns / (ITERATIONS * 2));
+    
+    free(stack);
+    return EXIT_SUCCESS;
+}
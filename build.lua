@@ -41,6 +41,22 @@ default("GTK_LIBRARIES", {"dl"})
 default("GTK_LIB_DEPENDENCIES", {})
 default("GTK_DEPENDENCIES", {"lua"});
 
+-- build the XCB output backend (GM_OUTPUT_XCB), needs libxcb-xtest and libxcb-keysyms
+default("XCB", false)
+if XCB then
+    DEPENDENCIES[#DEPENDENCIES + 1] = "xcb"
+    DEPENDENCIES[#DEPENDENCIES + 1] = "xcb-xtest"
+    DEPENDENCIES[#DEPENDENCIES + 1] = "xcb-keysyms"
+end
+
+-- build the Lua binding against LuaJIT instead of PUC Lua, for the FFI fast path (gmacros_ffi.lua)
+default("LUAJIT", false)
+if LUAJIT then
+    for i = 1, #DEPENDENCIES do
+        if DEPENDENCIES[i] == "lua" then DEPENDENCIES[i] = "luajit-5.1" end
+    end
+end
+
 for i = 1, #DEPENDENCIES do dep(DEPENDENCIES[i]) end
 for i = 1, #GTK_DEPENDENCIES do gtk_dep(GTK_DEPENDENCIES[i]) end
 
@@ -51,6 +67,14 @@ default("COMPILER", "gcc")
 
 default("COMPILER_ARGS", "-fPIC -Wall -Werror -pthread -march=native -O2 ")
 default("COMPILER_DEBUG_ARGS", "-fPIC -Wall -Wextra -pthread -O0 -ggdb -DDEBUG_MODE=1")
+if XCB then
+    COMPILER_ARGS = COMPILER_ARGS .. "-DGM_XCB=1 "
+    COMPILER_DEBUG_ARGS = COMPILER_DEBUG_ARGS .. " -DGM_XCB=1"
+end
+if LUAJIT then
+    COMPILER_ARGS = COMPILER_ARGS .. "`pkg-config --cflags luajit` "
+    COMPILER_DEBUG_ARGS = COMPILER_DEBUG_ARGS .. " `pkg-config --cflags luajit`"
+end
 
 default("GTK_COMPILER_ARGS", "-Wall -Werror -pthread -march=native -O2 " .. GTK_CFLAGS)
 default("GTK_COMPILER_DEBUG_ARGS", "-Wall -Wextra -pthread -O0 -ggdb -DDEBUG_MODE=1 " .. GTK_CFLAGS)
@@ -88,6 +112,10 @@ default("GTK_HEADERS", "app/gen")
 
 -- final executable or library name
 default("FINAL", "libgmacros.so")
+-- LuaJIT FFI declarations of api/gmacros.h, written next to FINAL
+default("FFI_MODULE", "gmacros_ffi.lua")
+-- interpreter for the Lua benchmarks in bench/
+default("BENCH_LUA", LUAJIT and "luajit" or "lua")
 default("GTK_FINAL", "gmacros")
 
 -- whether to strip source files for iheader syntax, and to generate headers
@@ -148,6 +176,67 @@ function mkdirs(...)
     end
 end
 
+-- string hash used by the generated key name tables, mirrored by gm_mapped_hash in
+-- libgmacros.c. Polynomial with a seed dependent odd base; every intermediate value
+-- stays below 2^53, so it is exact on LuaJIT and Lua 5.1 doubles as well as 5.3 integers.
+function mapped_hash(seed, str)
+    local h, m = 5381, 33 + 2 * seed
+    for i = 1, #str do
+        h = (h * m + string.byte(str, i)) % 4294967296
+    end
+    return h
+end
+
+-- Minimal perfect hash over a list of unique strings (hash and displace). Keys are
+-- grouped into #keys buckets by mapped_hash(0, key); the largest buckets are placed
+-- first by searching for a seed that sends all of their keys to distinct free slots.
+-- Single key buckets then take the remaining slots directly, stored as -(slot + 1).
+-- Returns the displacement per bucket and the key stored in each slot.
+function perfect_hash(keys)
+    local n = #keys
+    local buckets, disp, slots = {}, {}, {}
+    for i = 1, n do
+        buckets[i] = { idx = i }
+        disp[i] = 0
+    end
+    for i = 1, #keys do
+        local b = buckets[mapped_hash(0, keys[i]) % n + 1]
+        b[#b + 1] = keys[i]
+    end
+    table.sort(buckets, function(a, b)
+        if #a ~= #b then return #a > #b end
+        return a.idx < b.idx
+    end)
+    
+    local free = 1
+    for i = 1, n do
+        local b = buckets[i]
+        if #b > 1 then
+            local seed = 1
+            while true do
+                local taken, ok = {}, true
+                for j = 1, #b do
+                    local s = mapped_hash(seed, b[j]) % n + 1
+                    if slots[s] ~= nil or taken[s] then ok = false break end
+                    taken[s] = true
+                end
+                if ok then break end
+                seed = seed + 1
+                if seed >= 1048576 then error("perfect_hash(): no displacement found") end
+            end
+            for j = 1, #b do
+                slots[mapped_hash(seed, b[j]) % n + 1] = b[j]
+            end
+            disp[b.idx] = seed
+        elseif #b == 1 then
+            while slots[free] ~= nil do free = free + 1 end
+            slots[free] = b[1]
+            disp[b.idx] = -free -- -(zero based slot + 1)
+        end
+    end
+    return disp, slots
+end
+
 -- goals
 goals = {
     prep = function()
@@ -168,7 +257,7 @@ goals = {
     end,
     parse_event_codes = function()
         local f = io.open("/usr/include/linux/input-event-codes.h", "r")
-        local parsed = {}
+        local parsed, order = {}, {}
         if f then
             for line in f:lines() do
                 local start, fin = string.find(line, "#define KEY_", last, true)
@@ -190,10 +279,30 @@ goals = {
                     end
 
                     local num = string.sub(line, fin, fin + off - 1)
+                    if parsed[name] == nil then order[#order + 1] = name end
                     parsed[name] = num
                 end
             end
             io.close(f);
+            
+            -- sorted, so the output does not depend on pairs() order
+            local names = {}
+            for name in pairs(parsed) do names[#names + 1] = name end
+            table.sort(names)
+            local disp, slots = perfect_hash(names)
+            
+            -- reverse table: the first name defined with a literal value wins, aliases
+            -- (values naming another KEY_ macro) and the KEY_MAX bound are skipped
+            local reverse, codes = {}, {}
+            for i = 1, #order do
+                local code = tonumber(parsed[order[i]])
+                if code ~= nil and order[i] ~= "MAX" and reverse[code] == nil then
+                    reverse[code] = order[i]
+                    codes[#codes + 1] = code
+                end
+            end
+            table.sort(codes)
+            
             f = io.open("gen/mapped-codes.h", "w");
 
             if f == nil then
@@ -201,9 +310,25 @@ goals = {
             end
 
             f:write("#include <linux/input-event-codes.h>\n")
-            f:write("struct {const char* name; unsigned int code;} gm_mapped[] = {\n");
-            for name, num in pairs(parsed) do
-                f:write(string.format("{\"%s\",%s},\n", name, num))
+            f:write("/* key names, in perfect hash slot order (see perfect_hash in build.lua) */\n")
+            f:write("static const struct {const char* name; unsigned int code;} gm_mapped[] = {\n");
+            for i = 1, #slots do
+                f:write(string.format("{\"%s\",%s},\n", slots[i], parsed[slots[i]]))
+            end
+            f:write("};\n");
+            f:write("/* per bucket seed for gm_mapped_hash, or -(slot + 1) for single key buckets */\n")
+            f:write("static const int gm_mapped_disp[] = {\n");
+            for i = 1, #disp do
+                f:write(string.format("%d,%s", disp[i], i % 16 == 0 and "\n" or ""))
+            end
+            f:write("\n};\n");
+            f:write("/* canonical key name for each code */\n")
+            f:write("static const char* const gm_mapped_names[KEY_MAX + 1] = {\n");
+            local max = tonumber(parsed["MAX"])
+            for i = 1, #codes do
+                if codes[i] <= max then
+                    f:write(string.format("[%d] = \"%s\",\n", codes[i], reverse[codes[i]]))
+                end
             end
             f:write("};\n");
             io.close(f);
@@ -211,6 +336,68 @@ goals = {
             error("failed to locate input-event-codes.h for parsing");
         end
     end,
+    ffi_cdef = function()
+        local f = io.open("api/gmacros.h", "r")
+        if f == nil then
+            error("failed to read api/gmacros.h")
+        end
+        local src = "\n" .. f:read("*a")
+        io.close(f)
+        
+        -- numeric GM_XXX macros become module fields, all other preprocessor lines are dropped
+        local consts = {}
+        for name, value in src:gmatch("\n#define%s+(GM_[%w_]+)%s+(%-?%d+)") do
+            consts[#consts + 1] = string.format("    %s = %s,\n", name, value)
+        end
+        src = src:gsub("/%*.-%*/", "")
+        src = src:gsub("\n%s*#[^\n]*", "\n")
+        src = src:gsub("GM_API%s+", "")
+        src = src:gsub("[ \t]+\n", "\n")
+        src = src:gsub("\n\n\n+", "\n\n")
+        
+        writeb("generating FFI module: ", TERM_GREEN)
+        print(FFI_MODULE)
+        f = io.open(FFI_MODULE, "w")
+        if f == nil then
+            error("failed to write " .. FFI_MODULE)
+        end
+        f:write("-- generated by build.lua from api/gmacros.h\n")
+        f:write("local ffi = require(\"ffi\")\n\n")
+        f:write("ffi.cdef[[" .. src .. "]]\n\n")
+        f:write("local M = {\n" .. table.concat(consts) .. "}\n")
+        f:write([[
+
+--[=[
+  The gmh_* functions called through M.C are plain C calls that JIT-compiled traces
+  keep, where each gm.* call of the classic binding is a trace exit. Keep sleeping and
+  waiting on gm.sleep and gm.wait though: they suspend the handler (switching its C
+  stack, or yielding a coroutine mode macro) while other macros run Lua code, which
+  must not happen in the middle of a compiled FFI call.
+  
+    local gmffi = require("gmacros_ffi")
+    local C, h = gmffi.load(), gmffi.handle() -- after gm.init
+    local a = C.gm_key_resolve(h, "a") -- an int here, gm.keycode ids are Lua values
+    C.gmh_key_code(h, 1, a)
+]=]
+
+-- ffi.C if the library is linked into the executable or loaded globally, else ffi.load(path)
+function M.load(path)
+    if M.C == nil then
+        M.C = pcall(function() return ffi.C.gmh_key_code end) and ffi.C
+            or ffi.load(path or "./libgmacros.so")
+    end
+    return M.C
+end
+
+-- the handle from gm.init as a gm_handle cdata
+function M.handle()
+    return ffi.cast("gm_handle", gm.handle())
+end
+
+return M
+]])
+        io.close(f)
+    end,
     debug = function()
         COMPILER_ARGS = COMPILER_DEBUG_ARGS
         GTK_COMPILER_ARGS = GTK_COMPILER_DEBUG_ARGS
@@ -415,6 +602,7 @@ goals = {
         goals.prep()
         goals.parse_event_codes()
         goals.lib(debug_mode)
+        goals.ffi_cdef()
         goals.test()
         goals.app(debug_mode)
     end,
@@ -434,6 +622,34 @@ goals = {
             error("failed to run tests")
         end
     end,
+    bench = function()
+        goals.load_native()
+        goals.prep()
+        goals.parse_event_codes()
+        goals.lib()
+        writeb("compiling benchmarks...\n", TERM_GREEN);
+        for k, entry in sort_files("bench", "c") do
+            local out = "tmp/bench-" .. entry.filen
+            local cmd = COMPILER .. " -O2 -Iapi -I" .. HEADERS .. " " .. entry.full
+                .. " -L. -lgmacros -o " .. out .. " -Wl,-R -Wl,./"
+            printcmd(cmd)
+            if (os.execute(cmd) ~= 0) then
+                error("failed to compile benchmark: " .. entry.full)
+            end
+            writeb("running " .. out .. "\n", TERM_GREEN);
+            if (os.execute("./" .. out) ~= 0) then
+                error("benchmark failed: " .. entry.full)
+            end
+        end
+        goals.ffi_cdef()
+        for k, entry in sort_files("bench", "lua") do
+            local cmd = BENCH_LUA .. " " .. entry.full
+            printcmd(cmd)
+            if (os.execute(cmd) ~= 0) then
+                error("benchmark failed: " .. entry.full)
+            end
+        end
+    end,
     install = function()
         goals.load_native()
         goals.prep()
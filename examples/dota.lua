@@ -14,13 +14,6 @@ gm.init("/dev/input/by-path/pci-0000:00:1d.0-usb-0:1.6.3:1.0-event-kbd", setting
 enabled = false -- global macro toggle
 select_clone = "5"
 
-gm.sim = function(key)
-    gm.flush(false)
-    gm.key(true, key)
-    gm.key(false, key)
-    gm.flush(true)
-end
-
 gm.click = function(button)
     gm.flush(false)
     gm.mouse(true, button)
@@ -247,11 +240,11 @@ function laughspam_end(value)
 end
 
 gm.register("F11", toggle)
-gm.register("F10", function (value) gm.move(720, 980) end)
+gm.register("F10", gm.sequence{ {"move", 720, 980} }) -- interpreted, no handler at all
 
 gm.register("SPACE", mapgrab)
 
-gm.register("F2", laughspam)
+gm.register("F2", laughspam, {coroutine = true}) -- sleeps as a Lua coroutine, no C stack
 gm.register("F3", laughspam_end)
 
 ctrl_state = 0
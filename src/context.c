@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <context.h>
+
+@ {
+    /*
+      Minimal coroutine context. On x86-64 and aarch64 the callee-saved registers are
+      pushed onto the suspended stack by gmi_ctx_switch (ctxswitch.S), so only the stack
+      pointer needs to be stored; the signal mask is never touched. Other targets fall
+      back to ucontext.
+    */
+    #if defined(__x86_64__) || defined(__aarch64__)
+    #define GMI_CTX_ASM 1
+    typedef struct {
+        void* sp;
+    } gmi_ctx;
+    #else
+    #define GMI_CTX_ASM 0
+    #include <ucontext.h>
+    typedef struct {
+        ucontext_t uc;
+    } gmi_ctx;
+    #endif
+
+    /* prepare 'ctx' to call f(arg) on the given stack when first switched to. f must never return. */
+    void gmi_ctx_make   (gmi_ctx* ctx, void* stack, size_t size, void (*f)(void*), void* arg);
+    /* save the current context in 'from' and resume 'to' */
+    void gmi_ctx_switch (gmi_ctx* from, gmi_ctx* to);
+}
+
+#if GMI_CTX_ASM
+
+void gmi_ctx_trampoline(void); /* ctxswitch.S */
+
+void gmi_ctx_make(gmi_ctx* ctx, void* stack, size_t size, void (*f)(void*), void* arg) {
+    uintptr_t top = ((uintptr_t) stack + size) & ~(uintptr_t) 15;
+
+    #if defined(__x86_64__)
+    /*
+      initial frame, popped by gmi_ctx_switch from low to high addresses:
+      mxcsr/x87 cw, r15, r14, r13 (arg), r12 (f), rbx, rbp, return address.
+      The return address slot sits at top - 8, so the trampoline starts with
+      a 16-byte aligned stack pointer as the ABI expects before a call.
+    */
+    uint64_t* sp = (uint64_t*) (top - 8 * 8);
+    memset(sp, 0, 8 * 8);
+    sp[0] = 0x1F80ULL | (0x037FULL << 32); /* default mxcsr, x87 control word */
+    sp[3] = (uint64_t) (uintptr_t) arg;
+    sp[4] = (uint64_t) (uintptr_t) f;
+    sp[7] = (uint64_t) (uintptr_t) &gmi_ctx_trampoline;
+    #elif defined(__aarch64__)
+    /* initial frame: x19 (f), x20 (arg) ... x29 (fp), x30 (lr = trampoline), d8-d15 */
+    uint64_t* sp = (uint64_t*) (top - 20 * 8);
+    memset(sp, 0, 20 * 8);
+    sp[0]  = (uint64_t) (uintptr_t) f;
+    sp[1]  = (uint64_t) (uintptr_t) arg;
+    sp[11] = (uint64_t) (uintptr_t) &gmi_ctx_trampoline;
+    #endif
+
+    ctx->sp = sp;
+}
+
+#else
+
+/* makecontext only portably passes int arguments, so split the pointers */
+static void gmi_ctx_entry(unsigned int fhi, unsigned int flo, unsigned int ahi, unsigned int alo) {
+    void (*f)(void*) = (void (*)(void*)) (((uintptr_t) fhi << 16 << 16) | (uintptr_t) flo);
+    void* arg = (void*) (((uintptr_t) ahi << 16 << 16) | (uintptr_t) alo);
+    f(arg);
+    abort(); /* f must never return */
+}
+
+void gmi_ctx_make(gmi_ctx* ctx, void* stack, size_t size, void (*f)(void*), void* arg) {
+    uintptr_t fp = (uintptr_t) f, ap = (uintptr_t) arg;
+    getcontext(&ctx->uc);
+    ctx->uc.uc_link = NULL;
+    ctx->uc.uc_stack = (stack_t) { .ss_sp = stack, .ss_size = size };
+    makecontext(&ctx->uc, (void (*)()) gmi_ctx_entry, 4,
+                (unsigned int) (fp >> 16 >> 16), (unsigned int) fp,
+                (unsigned int) (ap >> 16 >> 16), (unsigned int) ap);
+}
+
+void gmi_ctx_switch(gmi_ctx* from, gmi_ctx* to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+#endif
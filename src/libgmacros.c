@@ -2,21 +2,30 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 
 #include <time.h>
 
 #include <fcntl.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+
 #include <linux/input.h>
 
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
-#include <X11/extensions/XTest.h>
 
 #include <unistd.h>
-#include <ucontext.h> /* we need to do some low-level context switching for the gmh_sleep implementation */
 
 #include <pthread.h>
 
@@ -24,113 +33,946 @@
 
 #include <gmacros.h>
 
+#include <context.h> /* we need to do some low-level context switching for the gmh_sleep implementation */
+#include <output.h>
 #include <libgmacros.h>
 
 @ {
+    #include <linux/input.h> /* KEY_MAX and struct input_event, for the listener */
+    
+    /*
+      coroutine stack, mmap'd with a PROT_NONE guard page below it. This header
+      lives at the very top of the mapping, the stack grows down from it.
+    */
+    typedef struct gmi_stack {
+        struct gmi_stack* next; /* free list link */
+        uint8_t* base;          /* lowest usable address, just above the guard page */
+        size_t size;            /* usable bytes below this header */
+        size_t hwm;             /* high-water mark in bytes, only tracked with stack_debug */
+    } gmi_stack;
+    
+    struct gmi_routine;
+    struct gmi_latch;
+    
+    #define GMI_TRIGGER_KEY      0 /* "A"                                     */
+    #define GMI_TRIGGER_CHORD    1 /* "LEFTCTRL+LEFTSHIFT+X", all keys held    */
+    #define GMI_TRIGGER_SEQUENCE 2 /* "Q,W,E" or "Q,W,E/300", presses in order */
+    #define GMI_TRIGGER_MAX      16 /* keys per chord or sequence              */
+    
     typedef struct gm_macro_node {
         struct gm_macro_node* next;
         gm_macro* macro;
-        unsigned int keycode;
+        unsigned int keycode; /* the key, or the last key of a chord or sequence */
+        unsigned int worker;  /* index of the worker whose queue its triggers go to */
         struct {
-            ucontext_t context;
-            uint8_t stack[1024 * 1024];
-            int req_sleep_time;
-            volatile bool running;     /* used by wrapper         */
-            bool returned;             /* used by gmi_sleep, wait */
-            bool waiting;              /* used by wait            */
-            struct wrapper_data* data; /* used by wait            */
+            int kind;                              /* GMI_TRIGGER_XXX                         */
+            unsigned short codes[GMI_TRIGGER_MAX];
+            unsigned int ncodes;
+            uint64_t window;                       /* sequences: max microseconds per step    */
+            bool down;                             /* chords: matched and still held (listener) */
+        } trigger;
+        /* invocation state, guarded by inst_lock */
+        struct {
+            struct gmi_routine* instances; /* in-flight invocations      */
+            struct gmi_routine* queue;     /* GM_POLICY_QUEUE triggers   */
+            struct gmi_routine* queue_end;
+            unsigned int active;           /* length of 'instances'      */
+            unsigned int queued;           /* length of 'queue'          */
+            size_t stack_hwm;              /* largest stack use seen     */
+            _Atomic unsigned int refs;     /* routines not yet freed, see routine_free */
         } routine;
+        /* counters for gm_macro_stats, written by the workers */
+        struct {
+            unsigned long invocations; /* under inst_lock */
+            unsigned long dropped;     /* under inst_lock */
+            _Atomic unsigned long long handler_ns; /* added to by any worker */
+        } stats;
     } gm_macro_node;
 
+    /* latency histogram in nanoseconds, see hist_bucket. Written by one worker */
+    #define GMI_HIST_BUCKETS 496
+    typedef struct {
+        _Atomic uint64_t max;
+        _Atomic uint32_t b[GMI_HIST_BUCKETS];
+    } gmi_hist;
+    
+    /* the histograms of all workers added up, for gm_stats */
+    typedef struct {
+        unsigned long count;
+        uint64_t max;
+        uint32_t b[GMI_HIST_BUCKETS];
+    } gmi_hist_sum;
+    
+    /* counters with a single writing thread, read by gm_stats without a lock */
+    #define COUNT_GET(c)    atomic_load_explicit(&(c), memory_order_relaxed)
+    #define COUNT_ADD(c, v) atomic_store_explicit(&(c), COUNT_GET(c) + (v), memory_order_relaxed)
+
+    /* compiled gm_sequence instructions, see sequence_run */
+    #define GMI_OP_END     0
+    #define GMI_OP_KEY     1 /* a: key id (gm_key_resolve), press        */
+    #define GMI_OP_BUTTON  2 /* a: button, press                          */
+    #define GMI_OP_MOVE    3 /* a, b: position                            */
+    #define GMI_OP_SLEEP   4 /* a: microseconds                           */
+    #define GMI_OP_SAVE    5 /* remember the pointer position             */
+    #define GMI_OP_RESTORE 6 /* move back to it                           */
+    
+    typedef struct {
+        uint8_t op;
+        uint8_t press;
+        int32_t a, b;
+    } gmi_op;
+
+    typedef struct gmi_sequence {
+        size_t len; /* including the GMI_OP_END */
+        _Atomic unsigned int refs; /* the owner and each routine running it */
+        gmi_op ops[];
+    } gmi_sequence;
+
+    /* a single invocation of a macro handler, or a gm_sched task */
+    typedef struct gmi_routine {
+        gmi_ctx context;
+        gmi_stack* stack;          /* NULL until the first run          */
+        struct gmi_handle* h;
+        struct gmi_worker* worker; /* runs it from the first run on, NULL before */
+        gm_macro_node* node;       /* NULL for gm_sched tasks           */
+        struct gmi_routine* next;  /* node instance list or queue link, then flush_wait */
+        struct gmi_latch* _Atomic latch; /* latch this routine is waiting on */
+        void (*task)(void*);       /* gm_sched function                 */
+        void* arg;                 /* gm_sched argument                 */
+        gmi_sequence* sequence;    /* interpreted instead, no stack     */
+        unsigned int pc;           /* next instruction of 'sequence'    */
+        int sx, sy;                /* GMI_OP_SAVE position              */
+        void* state;               /* gm_macro.step state               */
+        int value;                 /* trigger value                     */
+        uint64_t req_sleep_time;   /* nanoseconds                       */
+        /* CLOCK_MONOTONIC stage timestamps (ns), 0 if unknown */
+        uint64_t t_event;          /* evdev timestamp of the trigger    */
+        uint64_t t_listen;         /* read by the listener              */
+        uint64_t t_submit;         /* handed to the scheduler           */
+        uint64_t t_start;          /* first run of the handler          */
+        uint64_t t_output;         /* first output flushed to X         */
+        uint64_t run_ns;           /* time spent running the handler    */
+        bool admitted;             /* passed the macro's policy         */
+        _Atomic bool cancelled;    /* discarded by GM_POLICY_RESTART    */
+        bool returned;             /* handler has finished              */
+        bool waiting;              /* used by wait                      */
+    } gmi_routine;
+
     typedef struct gmi_latch {
-        gm_macro_node** links;
+        pthread_spinlock_t lock; /* routines on different workers wait and open */
+        gmi_routine** links;
         size_t linksz;
         size_t idx;
         bool state; /* true for open, false for closed */
     } gmi_latch;
     
     typedef struct lnode {
-        struct lnode* next;
+        struct lnode* next; /* link in the submission queue or a ready list */
         void (*f) (void*);
-        long target; /* millis, 0 for immediate */
+        uint64_t target;    /* CLOCK_MONOTONIC nanoseconds, 0 for immediate */
+        uint64_t seq;       /* insertion order, keeps events with equal targets FIFO */
         void* arg;
     } lnode;
 
-    /* internal handle data */
+    /*
+      fixed-size object pool. Free objects are linked through their first word,
+      the preallocated slab is never freed per-object, and anything allocated past
+      the slab is cached up to 'cap' free objects before going back to malloc.
+    */
     typedef struct {
-        const char* dev;
-        gm_macro* active;
+        pthread_spinlock_t lock;
+        void* free;
+        uint8_t* slab;
+        size_t slab_len;
+        size_t size;
+        size_t cap;
+        size_t nfree;
+        size_t used;
+        size_t peak;
+        size_t misses;
+    } gmi_pool;
+
+    /* binary min-heap of pending events, ordered by (target, seq) */
+    typedef struct {
+        lnode** nodes;
+        size_t len;
+        size_t cap;
+        uint64_t seq;
+    } gmi_heap;
+
+    /* an input device watched by the listener */
+    typedef struct gmi_device {
+        struct gmi_device* next;
+        char* path;                   /* as passed to gm_device_add                          */
+        const char* name;             /* last path component, matched against inotify events */
+        uint64_t id;                  /* listener epoll key                                  */
+        int fd;                       /* -1 while the device is absent                       */
+        int wd;                       /* inotify watch on the parent directory, or -1        */
+        struct input_event frame[32]; /* EV_KEY events of the current SYN_REPORT frame       */
+        size_t nframe;
+        bool dropped;                 /* SYN_DROPPED seen, discard until the next SYN_REPORT */
+        bool monotonic;               /* event timestamps are on CLOCK_MONOTONIC             */
+        int rel_x, rel_y;             /* pointer motion of the current frame                 */
+    } gmi_device;
+
+    /*
+      sequence triggers, compiled by seq_rebuild into one Aho-Corasick automaton with a
+      dense transition table. Columns are the keys used by any sequence, column 0 is
+      every other key. Each state lists the sequences that end in it.
+    */
+    typedef struct {
+        unsigned short cls[KEY_MAX + 1]; /* key code -> column                              */
+        unsigned int ncls;
+        unsigned int nstates;             /* 0 when there are no sequences                  */
+        unsigned int* delta;              /* nstates * ncls                                 */
+        uint64_t* window;                 /* per state, microseconds allowed to the next key */
+        unsigned int* out_first;          /* per state, slice of 'out'                      */
+        unsigned int* out_count;
+        gm_macro_node** out;
+        unsigned int state;               /* current state, listener thread only            */
+        uint64_t times[GMI_TRIGGER_MAX];  /* times of the last steps (microseconds), a ring  */
+        unsigned int pos;                 /* next slot in 'times'                           */
+    } gmi_seq;
+
+    /* an output key name interned by gm_key_resolve */
+    typedef struct {
+        char* name;
+        _Atomic uint64_t cache; /* key_gen << 32 | output code (-1 for none), gen 0 for never */
+    } gmi_key;
     
-        pthread_cond_t chain_cond;
-        pthread_mutex_t chain_lock;
+    /* linear probing table of interned key ids (-1 for empty), replaced when it grows */
+    typedef struct gmi_key_table {
+        struct gmi_key_table* prev; /* the table this one replaced, freed on close */
+        size_t mask;
+        _Atomic int slots[];
+    } gmi_key_table;
     
-        lnode* chain;
+    #define GMI_KEY_CHUNK  64   /* keys per block of the key cache       */
+    #define GMI_KEY_CHUNKS 1024 /* blocks, so at most 65536 interned keys */
+
+    /*
+      a scheduler thread (gm_settings.sched_workers), with its own event heap, output
+      connection and stacks. Everything here is private to it unless noted otherwise.
+      A routine stays on the worker that ran it first: its timers and resumes go there.
+    */
+    typedef struct gmi_worker {
+        struct gmi_handle* h;
+        unsigned int id;  /* index in h->workers */
+        pthread_t thread;
+        
+        pthread_cond_t chain_cond;   /* only used when tfd == -1 */
+        pthread_mutex_t chain_lock;  /* guards chain_cond waits, not the chain itself */
     
-        Display* display;
+        gmi_heap chain;
+
+        /*
+          lock-free multi-producer/single-consumer submission queue. Producers push
+          onto this stack, the worker takes the whole list and moves it into the chain.
+        */
+        _Atomic(lnode*) submit;
+        _Atomic bool sched_idle;         /* worker is (about to be) blocked          */
+        _Atomic uint64_t sched_deadline; /* target it is blocked on, UINT64_MAX for none */
+        
+        int tfd;  /* timerfd, -1 when waiting on chain_cond */
+        int efd;  /* wakeup eventfd                         */
+        int epfd; /* epoll instance (tfd, efd, xfd)         */
+        
+        /*
+          routines that have not run yet (with more than one worker), FIFO. Taken from
+          the head by this worker, and by idle workers when it is busy, see fresh_take.
+        */
+        pthread_mutex_t fresh_lock;
+        lnode* fresh;
+        lnode** fresh_end;
+        _Atomic size_t nfresh;
+        _Atomic unsigned long stolen; /* routines this worker took from other queues */
+        
+        gmi_ctx context; /* scheduler context, switched back to by handlers */
+        gmi_routine* active_handler;
+        bool flush;
+        
+        Display* display; /* NULL if the uinput output runs without X */
+        int xfd;          /* output (X) connection, in epfd; -1 if not */
+        bool x_ready;     /* X connection readable */
+        gmi_uinput uinput;
+        gmi_xcb xcb;
+        
+        /* cached coroutine stacks, the counters are read by gm_stats */
+        gmi_stack* spare;  /* stack new invocations start on, see gm_wrapper */
+        gmi_stack* stacks;
+        _Atomic size_t stacks_free;
+        _Atomic size_t stacks_used;
+        _Atomic size_t stacks_peak;
+        _Atomic size_t stacks_misses;
+        _Atomic size_t stacks_hwm;
+        
+        uint64_t pointer_sync;                 /* last real pointer query                    */
+        _Atomic unsigned long pointer_tracked; /* gmh_getmouse calls answered by the tracker */
+        _Atomic unsigned long pointer_queried; /* gmh_getmouse calls that asked the output   */
+        
+        /* output coalescing */
+        unsigned long out_pending;            /* events injected since the last flush        */
+        gmi_routine* flush_wait;              /* finished invocations whose output is pending */
+        _Atomic unsigned long output_events;  /* events flushed                              */
+        _Atomic unsigned long output_flushes;
+        
+        /* latency histograms, summed by gm_stats */
+        gmi_hist lat_kernel;   /* evdev timestamp -> listener read      */
+        gmi_hist lat_listener; /* listener read -> scheduler submission */
+        gmi_hist lat_queue;    /* submission -> handler started         */
+        gmi_hist lat_output;   /* handler started -> first output       */
+        gmi_hist lat_total;    /* evdev timestamp -> first output       */
+        gmi_hist lat_handler;  /* handler run time per invocation       */
+    } gmi_worker;
+
+    /* internal handle data */
+    typedef struct gmi_handle {
+        gm_macro* active;
+        
+        gmi_worker* workers;
+        unsigned int nworkers;
+        _Atomic unsigned int next_worker; /* round robin for new macros and outside tasks */
+        
+        /* macro invocation state (gm_macro_node.routine) and the policy counters */
+        pthread_mutex_t inst_lock;
+        
+        const gmi_output* out;
+        
+        /*
+          key name -> code cache, a linear probing table over the keys. Ids handed out by
+          gm_key_resolve index 'key_chunks' and stay valid; codes are resolved on first
+          use and again after a keyboard MappingNotify bumps key_gen. Blocks never move
+          and replaced tables stay allocated until close, so gmh_key and gmh_key_code
+          read without key_lock, which only guards interning.
+        */
+        pthread_mutex_t key_lock;
+        gmi_key* key_chunks[GMI_KEY_CHUNKS];
+        _Atomic size_t keys_len;
+        _Atomic(gmi_key_table*) key_table;
+        _Atomic unsigned int key_gen; /* bumped by the workers */
     
         pthread_t thread;
-        pthread_t lthread;
-        volatile bool lthread_control;
-
-        bool flush;
+        volatile bool lthread_control; /* workers and listener keep running */
     
-        int fd; /* device fd */
+        gmi_device* devices;      /* guarded by dev_lock */
+        pthread_mutex_t dev_lock;
+        uint64_t dev_seq;         /* next device id */
+        int lepfd; /* listener epoll instance (lefd, ifd, devices) */
+        int lefd;  /* listener wakeup eventfd                       */
+        int ifd;   /* inotify instance for hotplug, -1 if unavailable */
 
         gm_macro_node* macro_chain;
 
-        volatile bool listening;
-
-        ucontext_t context;
-
-        gm_macro_node* active_handler;
+        /*
+          keycode indexed view of macro_chain for listen(), rebuilt by dispatch_rebuild.
+          Macros for a code are dispatch_nodes[first .. first + count), in registration
+          order; the bitmap rejects codes without macros before touching the table.
+        */
+        uint64_t dispatch_mask[KEY_MAX / 64 + 1];
+        struct { unsigned short first, count; } dispatch[KEY_MAX + 1];
+        gm_macro_node** dispatch_nodes;
+        
+        uint64_t held[KEY_MAX / 64 + 1]; /* keys currently down, for chords (listener thread) */
+        bool chords_synced; /* chord 'down' flags checked against held since dispatch resumed */
+        
+        gmi_seq seq; /* sequence triggers */
+        
+        /* timestamps of the event being dispatched, for gm_routine_entry (listener thread) */
+        uint64_t event_time;  /* 0 if the device clock is not monotonic */
+        uint64_t listen_time;
 
-        struct sigaction sa;
+        volatile bool listening;
 
         void* lstate;
+        void* lcoroutine; /* Lua thread of the coroutine mode macro being resumed */
+        pthread_mutex_t llock; /* held by whichever thread runs Lua, see luabinds.c */
 
         const gm_settings* settings;
+        size_t stack_size;  /* settings->stack_size, or the default if zero  */
+        size_t stack_cache; /* settings->stack_cache, or the default if zero */
+        unsigned int instance_limit; /* settings->instance_limit, or the default if zero */
+        uint64_t sequence_window;    /* settings->sequence_window (or the default) in us */
+
+        gmi_pool lnode_pool;   /* lnode                */
+        gmi_pool routine_pool; /* gmi_routine          */
+
+        /* invocation policy counters, under inst_lock */
+        unsigned long policy_dropped;
+        unsigned long policy_queued;
+        unsigned long policy_restarted;
+        unsigned long policy_parallel;
+        
+        /*
+          tracked pointer position (pointer_pack), POINTER_NONE until known. Set by gmh_move
+          and real queries on the workers, moved by EV_REL deltas from the listener.
+        */
+        _Atomic uint64_t pointer;
+        int pointer_w, pointer_h;      /* screen size the position is clamped to       */
     } gmi_handle;
+
+    int gmi_key_code(const char* name); /* evdev code of an output key name, -1 if unknown */
 }
 
 const gm_settings gm_default_settings = {
-    .sched_intval = 50
+    .sched_intval = 50,
+    .sched_timerfd = 1,
+    .sched_workers = 1,
+    .pool_size = 256,
+    .stack_size = 1024 * 1024,
+    .stack_cache = 8,
+    .stack_debug = 0,
+    .instance_limit = 8,
+    .sequence_window = 300,
+    .output = GM_OUTPUT_XTEST,
+    .pointer_track = 0,
+    .output_coalesce = 1
 };
 
 #ifndef DEBUG_MODE
 #define DEBUG_MODE 0
 #endif
 
-#define SCHED(h, d, ...)                                                 \
-    chain_register_eventd(h, ({ void _fn(void* _ignored) __VA_ARGS__; _fn; }), d, NULL);
+#define SCHED(w, d, ...)                                                 \
+    chain_register_eventd(w, ({ void _fn(void* _ignored) __VA_ARGS__; _fn; }), d, NULL);
+
+#define SCHED_A(w, d, a, n, ...)                                         \
+    chain_register_eventd(w, ({ void _fn(void* n) __VA_ARGS__; _fn; }), d, a);
+
+static void chain_register_eventd(gmi_worker* w, void (*f) (void*), uint64_t delay, void* arg);
+static void sched_start(gmi_handle* h, gmi_routine* r);
+
+static __thread gmi_worker* gmi_self; /* the worker running on this thread, NULL elsewhere */
+
+/* the calling thread's worker, threads that are not one of h's workers use the first */
+static inline gmi_worker* worker_self(gmi_handle* h) {
+    return gmi_self && gmi_self->h == h ? gmi_self : h->workers;
+}
+
+/* current time on the monotonic clock, in nanoseconds */
+static inline uint64_t gmi_now(void) {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return ((uint64_t) tm.tv_sec * 1000000000ULL) + (uint64_t) tm.tv_nsec;
+}
+
+/* histogram bucket of a value: exact below 8, then 8 linear steps per power of two */
+static inline unsigned int hist_bucket(uint64_t v) {
+    if (v < 8) return (unsigned int) v;
+    unsigned int msb = 63 - (unsigned int) __builtin_clzll(v);
+    return (msb - 2) * 8 + (unsigned int) ((v >> (msb - 3)) & 7);
+}
+
+static void hist_add(gmi_hist* hs, uint64_t v) {
+    COUNT_ADD(hs->b[hist_bucket(v)], 1);
+    if (v > COUNT_GET(hs->max)) atomic_store_explicit(&hs->max, v, memory_order_relaxed);
+}
+
+/* upper bound of the bucket holding the q-th fraction of the samples */
+static uint64_t hist_quantile(const gmi_hist_sum* hs, double q) {
+    unsigned long want = (unsigned long) (q * (double) hs->count + 0.5), seen = 0;
+    unsigned int t;
+    if (want == 0) want = 1;
+    for (t = 0; t < GMI_HIST_BUCKETS; ++t) {
+        if ((seen += hs->b[t]) >= want) {
+            if (t < 8) return t;
+            unsigned int msb = t / 8 + 2;
+            uint64_t hi = ((uint64_t) (8 + t % 8 + 1) << (msb - 3)) - 1;
+            return hi < hs->max ? hi : hs->max;
+        }
+    }
+    return hs->max;
+}
+
+/* add the samples of 's' to 'd', counting what was read so a concurrent hist_add cannot skew it */
+static void hist_merge(gmi_hist_sum* d, gmi_hist* s) {
+    unsigned int t;
+    for (t = 0; t < GMI_HIST_BUCKETS; ++t) {
+        uint32_t n = COUNT_GET(s->b[t]);
+        d->b[t] += n;
+        d->count += n;
+    }
+    uint64_t max = COUNT_GET(s->max);
+    if (max > d->max) d->max = max;
+}
+
+static void hist_stats(const gmi_hist_sum* hs, gm_latency* l) {
+    *l = (gm_latency) {
+        .count = hs->count, .max = hs->max,
+        .p50 = hs->count ? hist_quantile(hs, 0.50) : 0,
+        .p99 = hs->count ? hist_quantile(hs, 0.99) : 0
+    };
+}
+
+static void pool_init(gmi_pool* p, size_t size, size_t cap) {
+    if (size < sizeof(void*)) size = sizeof(void*);
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    *p = (gmi_pool) {
+        .free = NULL, .slab = NULL, .slab_len = 0, .size = size, .cap = cap,
+        .nfree = 0, .used = 0, .peak = 0, .misses = 0
+    };
+    pthread_spin_init(&p->lock, PTHREAD_PROCESS_PRIVATE);
+    
+    if (cap && (p->slab = malloc(cap * size))) {
+        p->slab_len = cap * size;
+        size_t t;
+        for (t = cap; t-- > 0;) {
+            void* o = p->slab + t * size;
+            *(void**) o = p->free;
+            p->free = o;
+        }
+        p->nfree = cap;
+    }
+}
+
+static void pool_destroy(gmi_pool* p) {
+    void* c;
+    for (c = p->free; c != NULL;) {
+        void* tmp = c;
+        c = *(void**) c;
+        if (!((uint8_t*) tmp >= p->slab && (uint8_t*) tmp < p->slab + p->slab_len))
+            free(tmp);
+    }
+    free(p->slab);
+    pthread_spin_destroy(&p->lock);
+}
+
+static void* pool_alloc(gmi_pool* p) {
+    pthread_spin_lock(&p->lock);
+    void* o = p->free;
+    if (o) {
+        p->free = *(void**) o;
+        --p->nfree;
+    } else ++p->misses;
+    if (++p->used > p->peak) p->peak = p->used;
+    pthread_spin_unlock(&p->lock);
+    
+    return o ? o : malloc(p->size);
+}
+
+static void pool_free(gmi_pool* p, void* o) {
+    bool slab = (uint8_t*) o >= p->slab && (uint8_t*) o < p->slab + p->slab_len;
+    pthread_spin_lock(&p->lock);
+    --p->used;
+    if (slab || p->nfree < p->cap) {
+        *(void**) o = p->free;
+        p->free = o;
+        ++p->nfree;
+        o = NULL;
+    }
+    pthread_spin_unlock(&p->lock);
+    
+    free(o); /* past the retention limit */
+}
+
+#define STACK_FILL 0xA5 /* stack_debug fill pattern */
+
+/* size of the mapping (excluding the guard page) for a stack of at least 'size' bytes */
+static inline size_t stack_round(size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (size + sizeof(gmi_stack) + page - 1) & ~(page - 1);
+}
+
+/* find how deep a stack_debug stack has been used, from the untouched fill pattern */
+static size_t stack_measure(gmi_stack* st) {
+    size_t t = 0;
+    while (t < st->size && st->base[t] == STACK_FILL)
+        ++t;
+    return st->size - t;
+}
+
+/* restore the fill pattern over the part of a stack_debug stack that was used */
+static void stack_refill(gmi_stack* st) {
+    size_t used = stack_measure(st);
+    memset(st->base + st->size - used, STACK_FILL, used);
+}
+
+/* take a stack of at least 'size' bytes from the cache, or map a new one */
+static gmi_stack* stack_acquire(gmi_worker* w, size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size = stack_round(size);
+    
+    gmi_stack* st = NULL, ** prev;
+    for (prev = &w->stacks; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->size + sizeof(gmi_stack) == size) {
+            st = *prev;
+            *prev = st->next;
+            COUNT_ADD(w->stacks_free, -1);
+            break;
+        }
+    }
+    
+    if (st == NULL) {
+        COUNT_ADD(w->stacks_misses, 1);
+        /* pages are only faulted in when the coroutine actually touches them */
+        uint8_t* map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "mmap(): %s\n", strerror(errno));
+            return NULL;
+        }
+        mprotect(map, page, PROT_NONE); /* overflow faults instead of corrupting memory */
+        
+        st = (gmi_stack*) (map + page + size - sizeof(gmi_stack));
+        *st = (gmi_stack) { .next = NULL, .base = map + page, .size = size - sizeof(gmi_stack), .hwm = 0 };
+        
+        if (w->h->settings->stack_debug)
+            memset(st->base, STACK_FILL, st->size);
+    }
+    
+    COUNT_ADD(w->stacks_used, 1);
+    if (COUNT_GET(w->stacks_used) > COUNT_GET(w->stacks_peak))
+        atomic_store_explicit(&w->stacks_peak, COUNT_GET(w->stacks_used), memory_order_relaxed);
+    return st;
+}
+
+/* return a stack to the cache, unmapping it if the cache is full */
+static void stack_release(gmi_worker* w, gmi_stack* st) {
+    COUNT_ADD(w->stacks_used, -1);
+    if (COUNT_GET(w->stacks_free) < w->h->stack_cache) {
+        /* the next user measures its own depth */
+        if (w->h->settings->stack_debug) stack_refill(st);
+        st->next = w->stacks;
+        w->stacks = st;
+        COUNT_ADD(w->stacks_free, 1);
+    } else {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        munmap(st->base - page, st->size + sizeof(gmi_stack) + page);
+    }
+}
+
+static void pool_stats(gmi_pool* p, gm_pool_stats* s) {
+    pthread_spin_lock(&p->lock);
+    *s = (gm_pool_stats) {
+        .used = p->used, .free = p->nfree, .peak = p->peak, .misses = p->misses
+    };
+    pthread_spin_unlock(&p->lock);
+}
+/* static void chain_debug(gmi_worker* w); */
+
+/* must match mapped_hash in build.lua, which generates the tables in mapped-codes.h */
+static inline uint32_t gm_mapped_hash(uint32_t seed, const char* s) {
+    uint32_t h = 5381, m = 33 + 2 * seed;
+    while (*s) h = h * m + (unsigned char) *s++;
+    return h;
+}
+
+/* perfect hash lookup of a key name, returns the gm_mapped index or -1 */
+static int gm_mapped_find(const char* name) {
+    const size_t n = sizeof(gm_mapped) / sizeof(*gm_mapped);
+    int d = gm_mapped_disp[gm_mapped_hash(0, name) % n];
+    size_t slot;
+    if (d < 0) slot = (size_t) (-d - 1);
+    else if (d > 0) slot = gm_mapped_hash((uint32_t) d, name) % n;
+    else return -1; /* empty bucket */
+    return strcmp(gm_mapped[slot].name, name) ? -1 : (int) slot;
+}
+
+/*
+  evdev code for a key name given to gmh_key when output goes through uinput. Takes evdev
+  names, and the X keysym names scripts written against XTest use for common keys.
+*/
+int gmi_key_code(const char* name) {
+    static const char* const aliases[][2] = {
+        { "Return", "ENTER" },         { "Escape", "ESC" },             { "BackSpace", "BACKSPACE" },
+        { "Control_L", "LEFTCTRL" },   { "Control_R", "RIGHTCTRL" },    { "Shift_L", "LEFTSHIFT" },
+        { "Shift_R", "RIGHTSHIFT" },   { "Alt_L", "LEFTALT" },          { "Alt_R", "RIGHTALT" },
+        { "Super_L", "LEFTMETA" },     { "Super_R", "RIGHTMETA" },      { "ISO_Level3_Shift", "RIGHTALT" },
+        { "Caps_Lock", "CAPSLOCK" },   { "Num_Lock", "NUMLOCK" },       { "Scroll_Lock", "SCROLLLOCK" },
+        { "Prior", "PAGEUP" },         { "Next", "PAGEDOWN" },          { "Page_Up", "PAGEUP" },
+        { "Page_Down", "PAGEDOWN" },   { "Print", "SYSRQ" },            { "period", "DOT" },
+        { "bracketleft", "LEFTBRACE" }, { "bracketright", "RIGHTBRACE" }, { "Menu", "COMPOSE" }
+    };
+    char up[32];
+    size_t t;
+    int idx;
+    
+    if ((idx = gm_mapped_find(name)) != -1) return (int) gm_mapped[idx].code;
+    for (t = 0; t < sizeof(aliases) / sizeof(*aliases); ++t)
+        if (!strcmp(aliases[t][0], name)) {
+            /* the target may be missing from older input-event-codes.h */
+            idx = gm_mapped_find(aliases[t][1]);
+            return idx != -1 ? (int) gm_mapped[idx].code : -1;
+        }
+    
+    /* "a", "space", "F1", "KP_1" */
+    for (t = 0; name[t] && t < sizeof(up) - 1; ++t) up[t] = (char) toupper((unsigned char) name[t]);
+    up[t] = '\0';
+    if (!strncmp(up, "KP_", 3)) memmove(up + 2, up + 3, strlen(up + 3) + 1);
+    return (idx = gm_mapped_find(up)) != -1 ? (int) gm_mapped[idx].code : -1;
+}
+
+const char* gm_key_name(unsigned int code) {
+    return code <= KEY_MAX ? gm_mapped_names[code] : NULL;
+}
+
+/*
+  ask the kernel to only deliver EV_KEY events with bound codes, so ordinary typing, mouse
+  motion and EV_MSC scan codes never wake the listener. EV_SYN always passes, but the kernel
+  drops SYN_REPORT frames that end up empty. Sequences start over on any other key, so with
+  sequences registered every key is let through and only the other event types are masked.
+  Fails harmlessly on non-evdev files and kernels without EVIOCSMASK: listen_frame() sees
+  the extra keys, but they only reach seq_step, which is a no-op without sequences, before
+  the same bitmap rejects them. With pointer tracking, relative X/Y motion is let through
+  as well.
+*/
+static void listen_mask(gmi_handle* h, int fd) {
+    #ifdef EVIOCSMASK
+    uint64_t types = (1ULL << EV_SYN) | (1ULL << EV_KEY);
+    uint64_t rel = (1ULL << REL_X) | (1ULL << REL_Y);
+    uint64_t all[KEY_MAX / 64 + 1];
+    const uint64_t* keys = h->dispatch_mask;
+    if (h->seq.nstates) {
+        memset(all, 0xff, sizeof(all));
+        keys = all;
+    }
+    if (h->settings->pointer_track) types |= 1ULL << EV_REL;
+    struct input_mask m = { .type = 0, .codes_size = sizeof(types), .codes_ptr = (uintptr_t) &types };
+    ioctl(fd, EVIOCSMASK, &m);
+    m = (struct input_mask) {
+        .type = EV_KEY, .codes_size = sizeof(h->dispatch_mask), .codes_ptr = (uintptr_t) keys
+    };
+    ioctl(fd, EVIOCSMASK, &m);
+    m = (struct input_mask) { .type = EV_REL, .codes_size = sizeof(rel), .codes_ptr = (uintptr_t) &rel };
+    if (h->settings->pointer_track) ioctl(fd, EVIOCSMASK, &m);
+    #endif
+}
 
-#define SCHED_A(h, d, a, n, ...)                                         \
-    chain_register_eventd(h, ({ void _fn(void* n) __VA_ARGS__; _fn; }), d, a);
+#define POINTER_NONE UINT64_MAX
+#define POINTER_X(p) ((int) (uint32_t) ((p) >> 32))
+#define POINTER_Y(p) ((int) (uint32_t) (p))
 
-#define X11_KEYSYM(D, S) ((unsigned int) XKeysymToKeycode(D, XStringToKeysym(S)))
+/* pack a position for h->pointer, clamped to the screen */
+static inline uint64_t pointer_pack(gmi_handle* h, int x, int y) {
+    x = x < 0 ? 0 : x >= h->pointer_w ? h->pointer_w - 1 : x;
+    y = y < 0 ? 0 : y >= h->pointer_h ? h->pointer_h - 1 : y;
+    return ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+}
 
-static void chain_register_eventd(gmi_handle* h, void (*f) (void*), long delay, void* arg);
-/* static void chain_debug(gmi_handle* h); */
+/*
+  move the tracked position by raw device motion. This follows the real pointer as
+  long as X applies no acceleration; pointer_track bounds how long an error can last.
+*/
+static void pointer_add(gmi_handle* h, int dx, int dy) {
+    uint64_t p = atomic_load(&h->pointer), n;
+    do {
+        if (p == POINTER_NONE) return;
+        n = pointer_pack(h, POINTER_X(p) + dx, POINTER_Y(p) + dy);
+    } while (!atomic_compare_exchange_weak(&h->pointer, &p, n));
+}
+
+/* compile the sequence triggers of macro_chain, only called while not listening */
+static void seq_rebuild(gmi_handle* h) {
+    gmi_seq* q = &h->seq;
+    gm_macro_node* c;
+    unsigned int t, i, col, npat = 0, maxstates = 1;
+    
+    free(q->delta);
+    free(q->window);
+    free(q->out_first);
+    free(q->out_count);
+    free(q->out);
+    q->delta = NULL;
+    q->window = NULL;
+    q->out_first = q->out_count = NULL;
+    q->out = NULL;
+    q->nstates = q->state = 0;
+    
+    memset(q->cls, 0, sizeof(q->cls));
+    q->ncls = 1;
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        if (c->trigger.kind != GMI_TRIGGER_SEQUENCE) continue;
+        ++npat;
+        maxstates += c->trigger.ncodes;
+        for (t = 0; t < c->trigger.ncodes; ++t)
+            if (!q->cls[c->trigger.codes[t]]) q->cls[c->trigger.codes[t]] = q->ncls++;
+    }
+    if (!npat) return;
+    
+    const unsigned int ncls = q->ncls;
+    gm_macro_node** pat = malloc(npat * sizeof(*pat));
+    unsigned int* pat_state = malloc(npat * sizeof(*pat_state));
+    unsigned int* delta = calloc((size_t) maxstates * ncls, sizeof(*delta)); /* 0: no edge yet */
+    uint64_t* window = calloc(maxstates, sizeof(*window));
+    
+    /* trie of all sequences, in registration order. A state's window is the largest of the sequences through it */
+    unsigned int nstates = 1, p = 0;
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        if (c->trigger.kind != GMI_TRIGGER_SEQUENCE) continue;
+        unsigned int st = 0;
+        for (t = 0; t < c->trigger.ncodes; ++t) {
+            unsigned int* e = &delta[st * ncls + q->cls[c->trigger.codes[t]]];
+            if (!*e) *e = nstates++;
+            if (window[st] < c->trigger.window) window[st] = c->trigger.window;
+            st = *e;
+        }
+        pat[p] = c;
+        pat_state[p++] = st;
+    }
+    
+    /* breadth-first failure links, filling in the missing edges to get a complete table */
+    unsigned int* fail = calloc(nstates, sizeof(*fail));
+    unsigned int* order = malloc(nstates * sizeof(*order));
+    unsigned int head = 0, tail = 0;
+    for (col = 0; col < ncls; ++col)
+        if (delta[col]) order[tail++] = delta[col];
+    while (head < tail) {
+        unsigned int r = order[head++];
+        for (col = 0; col < ncls; ++col) {
+            unsigned int* e = &delta[r * ncls + col];
+            if (*e) {
+                fail[*e] = delta[fail[r] * ncls + col];
+                order[tail++] = *e;
+            } else *e = delta[fail[r] * ncls + col];
+        }
+        /* edges borrowed from the failure state continue its sequences, allow their window too */
+        if (window[r] < window[fail[r]]) window[r] = window[fail[r]];
+    }
+    
+    /* outputs: sequences ending in a state, plus those of its failure state (a suffix) */
+    unsigned int* own = calloc(nstates, sizeof(*own));
+    unsigned int* cnt = calloc(nstates, sizeof(*cnt));
+    unsigned int* first = malloc(nstates * sizeof(*first));
+    for (p = 0; p < npat; ++p) ++own[pat_state[p]];
+    for (t = 0; t < tail; ++t) cnt[order[t]] = own[order[t]] + cnt[fail[order[t]]];
+    unsigned int nout = 0;
+    for (t = 0; t < nstates; ++t) {
+        first[t] = nout;
+        nout += cnt[t];
+    }
+    unsigned int* out = malloc((nout ? nout : 1) * sizeof(*out)); /* pattern indices */
+    unsigned int* fill = calloc(nstates, sizeof(*fill));
+    for (p = 0; p < npat; ++p) out[first[pat_state[p]] + fill[pat_state[p]]++] = p;
+    for (t = 0; t < tail; ++t) {
+        unsigned int st = order[t], f = fail[st];
+        for (i = 0; i < cnt[f]; ++i) out[first[st] + fill[st]++] = out[first[f] + i];
+        /* keep registration order within the state, lists are short */
+        for (i = 1; i < cnt[st]; ++i) {
+            unsigned int v = out[first[st] + i], j = i;
+            for (; j > 0 && out[first[st] + j - 1] > v; --j) out[first[st] + j] = out[first[st] + j - 1];
+            out[first[st] + j] = v;
+        }
+    }
+    
+    q->out = malloc((nout ? nout : 1) * sizeof(*q->out));
+    for (t = 0; t < nout; ++t) q->out[t] = pat[out[t]];
+    q->delta = delta;
+    q->window = window;
+    q->out_first = first;
+    q->out_count = cnt;
+    q->nstates = nstates;
+    
+    free(out);
+    free(fill);
+    free(own);
+    free(order);
+    free(fail);
+    free(pat_state);
+    free(pat);
+}
+
+/* rebuild the dispatch table from macro_chain, only called while not listening */
+static void dispatch_rebuild(gmi_handle* h) {
+    gm_macro_node* c;
+    size_t n = 0, t, first = 0;
+    unsigned int i;
+    
+    memset(h->dispatch_mask, 0, sizeof(h->dispatch_mask));
+    memset(h->dispatch, 0, sizeof(h->dispatch));
+    
+    /* chords are listed under each of their keys, sequences are handled by the automaton */
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        for (i = 0; i < c->trigger.ncodes; ++i) {
+            h->dispatch_mask[c->trigger.codes[i] / 64] |= 1ULL << (c->trigger.codes[i] % 64);
+            if (c->trigger.kind == GMI_TRIGGER_SEQUENCE) continue;
+            ++h->dispatch[c->trigger.codes[i]].count;
+            ++n;
+        }
+    }
+    for (t = 0; t <= KEY_MAX; ++t) {
+        h->dispatch[t].first = first;
+        first += h->dispatch[t].count;
+        h->dispatch[t].count = 0;
+    }
+    
+    free(h->dispatch_nodes);
+    h->dispatch_nodes = n ? malloc(n * sizeof(*h->dispatch_nodes)) : NULL;
+    
+    /* the chain is in registration order, so each code's slice is too */
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        if (c->trigger.kind == GMI_TRIGGER_SEQUENCE) continue;
+        for (i = 0; i < c->trigger.ncodes; ++i) {
+            unsigned int code = c->trigger.codes[i];
+            h->dispatch_nodes[h->dispatch[code].first + h->dispatch[code].count++] = c;
+        }
+    }
+    seq_rebuild(h);
+    
+    gmi_device* d;
+    pthread_mutex_lock(&h->dev_lock);
+    for (d = h->devices; d != NULL; d = d->next)
+        if (d->fd != -1) listen_mask(h, d->fd);
+    pthread_mutex_unlock(&h->dev_lock);
+}
+
+/* parse a trigger: "KEY", a chord "A+B+C" or a sequence "A,B,C" with an optional "/ms" window */
+static int trigger_parse(gmi_handle* h, const char* str, gm_macro_node* n) {
+    char buf[256];
+    size_t len = strlen(str);
+    if (len >= sizeof(buf)) return 1;
+    memcpy(buf, str, len + 1);
+    
+    n->trigger.kind = strchr(buf, ',') ? GMI_TRIGGER_SEQUENCE
+        : strchr(buf, '+') ? GMI_TRIGGER_CHORD : GMI_TRIGGER_KEY;
+    n->trigger.window = h->sequence_window;
+    n->trigger.ncodes = 0;
+    n->trigger.down = false;
+    
+    char* w;
+    if (n->trigger.kind == GMI_TRIGGER_SEQUENCE && (w = strchr(buf, '/'))) {
+        char* e;
+        long ms = strtol(w + 1, &e, 10);
+        if (*e || ms <= 0) return 1;
+        n->trigger.window = (uint64_t) ms * 1000ULL;
+        *w = '\0';
+    }
+    
+    char sep = n->trigger.kind == GMI_TRIGGER_SEQUENCE ? ',' : '+';
+    char* tok = buf;
+    for (;;) {
+        char* end = strchr(tok, sep);
+        if (end) *end = '\0';
+        
+        /* match keycode with string */
+        int idx = gm_mapped_find(tok);
+        if (idx == -1 || gm_mapped[idx].code > KEY_MAX || n->trigger.ncodes == GMI_TRIGGER_MAX) return 1;
+        unsigned short code = (unsigned short) gm_mapped[idx].code;
+        
+        unsigned int t;
+        for (t = 0; n->trigger.kind == GMI_TRIGGER_CHORD && t < n->trigger.ncodes; ++t)
+            if (n->trigger.codes[t] == code) break;
+        if (n->trigger.kind != GMI_TRIGGER_CHORD || t == n->trigger.ncodes)
+            n->trigger.codes[n->trigger.ncodes++] = code;
+        
+        if (!end) break;
+        tok = end + 1;
+    }
+    n->keycode = n->trigger.codes[n->trigger.ncodes - 1];
+    return 0;
+}
 
 int gm_register(gm_handle _h, gm_macro* macro) {
     gmi_handle* h = (gmi_handle*) _h;
 
     if (h->listening) return 2;
 
-    /* match keycode with string */
-    unsigned int code;
-    bool match = false;
-    size_t t;
-    for (t = 0; t < sizeof(gm_mapped) / sizeof(*gm_mapped); ++t) {
-        if (!strcmp(gm_mapped[t].name, macro->key)) {
-            code = gm_mapped[t].code;
-            match = true;
-            break;
-        }
+    gm_macro_node* node = malloc(sizeof(struct gm_macro_node));
+    if (trigger_parse(h, macro->key, node)) {
+        free(node);
+        return 1;
     }
-    if (!match) return 1;
     
     #if DEBUG_MODE
-    printf("gm_register(): matched macro->key (%s) to code %d\n", macro->key, (int) code);
+    printf("gm_register(): matched macro->key (%s) to code %d\n", macro->key, (int) node->keycode);
     #endif
     
     gm_macro_node* end = h->macro_chain;
@@ -139,12 +981,22 @@ int gm_register(gm_handle _h, gm_macro* macro) {
     
     gm_macro_node** new = end == NULL ? &h->macro_chain : &(end->next); /* handle NULL chain */
     
-    *new = malloc(sizeof(struct gm_macro_node));
-    (*new)->keycode = code;
+    *new = node;
     (*new)->macro = macro;
     (*new)->next = NULL;
-    (*new)->routine.running = false;
+    (*new)->routine.instances = NULL;
+    (*new)->routine.queue = NULL;
+    (*new)->routine.queue_end = NULL;
+    (*new)->routine.active = 0;
+    (*new)->routine.queued = 0;
+    (*new)->routine.stack_hwm = 0;
+    (*new)->routine.refs = 0;
+    (*new)->stats.invocations = 0;
+    (*new)->stats.dropped = 0;
+    (*new)->stats.handler_ns = 0;
+    (*new)->worker = atomic_fetch_add(&h->next_worker, 1) % h->nworkers;
     
+    dispatch_rebuild(h);
     return 0;
 }
 
@@ -156,12 +1008,14 @@ int gm_unregister(gm_handle _h, gm_macro* macro) {
     gm_macro_node* c, * prev = NULL;
     for (c = h->macro_chain; c != NULL; c = c->next) {
         if (c->macro == macro) {
+            if (atomic_load(&c->routine.refs)) return 2; /* still running or restarted */
             if (prev == NULL) {
                 h->macro_chain = c->next ? c->next : NULL;
             } else {
                 prev->next = c->next;
             }
             free(c);
+            dispatch_rebuild(h);
             return 0;
         }
         prev = c;
@@ -175,428 +1029,1361 @@ int gm_unregister_all(gm_handle _h) {
     if (h->listening) return 2;
     
     gm_macro_node* c;
+    for (c = h->macro_chain; c != NULL; c = c->next)
+        if (atomic_load(&c->routine.refs)) return 2;
     for (c = h->macro_chain; c != NULL;) {
         gm_macro_node* tmp = c;
         c = c->next;
         free(tmp);
     }
     h->macro_chain = NULL;
+    dispatch_rebuild(h);
     
     return 0;
 }
 
-static void gm_routine(int value, gm_macro_node* c) {
-    c->macro->f(value, c->macro->arg);
-    c->routine.running = false;
+/* coroutine entry point, runs the handler and switches back for the last time */
+static void gm_routine(void* _r) {
+    gmi_routine* r = (gmi_routine*) _r;
+    
+    if (r->node)
+        r->node->macro->f(r->value, r->node->macro->arg);
+    else
+        r->task(r->arg);
+    
+    r->returned = true;
+    gmi_ctx_switch(&r->context, &r->worker->context);
 }
 
-/* data that is passed around with this handler */
-struct wrapper_data {
-    gm_macro_node* c;
-    gmi_handle* h;
-};
+static void gm_wrapper(void* _r);
 
-static void gm_wrapper(void* w) {
-    gm_macro_node* c = ((struct wrapper_data*) w)->c;
-    gmi_handle* h = ((struct wrapper_data*) w)->h;
-                            
-    h->active_handler = c;
-                        
-    c->routine.req_sleep_time = 0;
-    c->routine.waiting = false;
-                            
-    getcontext(&h->context); /* save current (return) context */
+/* drop an invocation from its macro's instance list */
+static void gm_instance_unlink(gm_macro_node* n, gmi_routine* r) {
+    gmi_routine** p;
+    for (p = &n->routine.instances; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            --n->routine.active;
+            return;
+        }
+    }
+}
 
-    if (c->routine.running) {
-        if (c->routine.req_sleep_time == 0) {
+/* stop r from being resumed by the latch it waits on, called with the latch locked */
+static void latch_unlink(gmi_routine* r) {
+    gmi_latch* l = atomic_load(&r->latch);
+    size_t t;
+    for (t = 0; t < l->idx; ++t) {
+        if (l->links[t] == r) {
+            l->links[t] = l->links[--l->idx];
+            break;
+        }
+    }
+    atomic_store(&r->latch, NULL);
+}
 
-            if (c->routine.waiting) {
-                /*
-                  a wait was triggered, so just store the wrapper (argument) data
-                  so we can wake up this macro later
-                 */
-                c->routine.data = (struct wrapper_data*) w;
-            } else {
-                /*
-                  if no sleep or wait was requested, this is probably the first
-                  invocation or a resume, so just execute in the current
-                  scheduled context.
-                */
-                setcontext(&c->routine.context);
-            }
-        } else {
-            /*
-              if we got here, a sleep was requested (jumped back to main context
-              with c->routine->req_sleep_time set), so we need to schedule again
-              to continue this context later.
-            */
-            chain_register_eventd(h, &gm_wrapper, c->routine.req_sleep_time, w);
+/* take r off the latch it waits on, false if it is not on one (or the latch opened first) */
+static bool latch_leave(gmi_routine* r) {
+    /* opened on another worker, which clears it under the latch's lock */
+    gmi_latch* l = atomic_load(&r->latch);
+    if (!l) return false;
+    pthread_spin_lock(&l->lock);
+    bool linked = atomic_load(&r->latch) == l;
+    if (linked) latch_unlink(r);
+    pthread_spin_unlock(&l->lock);
+    return linked;
+}
+
+/*
+  discard an invocation (GM_POLICY_RESTART), with inst_lock held. Nothing is unwound:
+  the worker it runs on frees it when its pending timer or resume event fires, and one
+  parked on a latch is taken off and resumed for that right away. Suspended invocations
+  of the calling worker go on 'reap', to release their stacks once the lock is dropped.
+*/
+static void gm_instance_cancel(gmi_worker* w, gmi_routine* r, gmi_routine** reap) {
+    bool parked = latch_leave(r);
+    if (r->worker == w && !parked) {
+        r->next = *reap;
+        *reap = r;
+    }
+    r->cancelled = true; /* another worker may free it from here on, unless it is parked */
+    if (parked) chain_register_eventd(r->worker, &gm_wrapper, 0, r);
+}
+
+/* drop a reference to a compiled sequence, the last one frees it */
+static void sequence_put(gmi_sequence* s) {
+    if (atomic_fetch_sub(&s->refs, 1) == 1) free(s);
+}
+
+/* free a routine, after which an idle macro may be unregistered */
+static void routine_free(gmi_handle* h, gmi_routine* r) {
+    if (r->node) atomic_fetch_sub(&r->node->routine.refs, 1);
+    if (r->sequence) sequence_put(r->sequence);
+    pool_free(&h->routine_pool, r);
+}
+
+/* give back the stack and step state of a discarded invocation, on its own worker */
+static void routine_release(gmi_worker* w, gmi_routine* r) {
+    const gm_macro* m = r->node->macro;
+    if (m->step && m->discard && r->state)
+        m->discard(m->arg, r->state);
+    r->state = NULL;
+    if (r->stack) {
+        stack_release(w, r->stack);
+        r->stack = NULL;
+    }
+}
+
+/*
+  apply the macro's invocation policy to a new trigger, with inst_lock held. Returns
+  true if the invocation should start now; otherwise it has been queued or freed.
+*/
+static bool gm_instance_admit(gmi_worker* w, gmi_routine* r, gmi_routine** reap) {
+    gmi_handle* h = w->h;
+    gm_macro_node* n = r->node;
+    unsigned int limit = n->macro->limit ? n->macro->limit : h->instance_limit;
+    
+    switch (n->macro->policy) {
+    case GM_POLICY_QUEUE:
+        if (n->routine.active == 0) break;
+        if (n->routine.queued >= limit) goto drop;
+        r->next = NULL;
+        if (n->routine.queue_end) n->routine.queue_end->next = r;
+        else n->routine.queue = r;
+        n->routine.queue_end = r;
+        ++n->routine.queued;
+        ++h->policy_queued;
+        return false;
+    case GM_POLICY_RESTART:
+        while (n->routine.instances) {
+            gmi_routine* old = n->routine.instances;
+            n->routine.instances = old->next;
+            --n->routine.active;
+            gm_instance_cancel(w, old, reap);
+            ++h->policy_restarted;
         }
+        break;
+    case GM_POLICY_PARALLEL:
+        if (n->routine.active >= limit) goto drop;
+        if (n->routine.active) ++h->policy_parallel;
+        break;
+    default: /* GM_POLICY_DROP */
+        if (n->routine.active) goto drop;
+        break;
+    }
+    
+    r->admitted = true;
+    r->next = n->routine.instances;
+    n->routine.instances = r;
+    ++n->routine.active;
+    ++n->stats.invocations;
+    return true;
+    
+ drop:
+    ++h->policy_dropped;
+    ++n->stats.dropped;
+    routine_free(h, r);
+    return false;
+}
+
+/* an invocation finished, returns the queued trigger to start next if any. With inst_lock held */
+static gmi_routine* gm_instance_done(gmi_routine* r) {
+    gm_macro_node* n = r->node;
+    gm_instance_unlink(n, r);
+    
+    gmi_routine* q = n->routine.queue;
+    if (q && n->routine.active == 0) {
+        if (!(n->routine.queue = q->next)) n->routine.queue_end = NULL;
+        --n->routine.queued;
+        q->admitted = true;
+        q->next = n->routine.instances;
+        n->routine.instances = q;
+        ++n->routine.active;
+        ++n->stats.invocations;
+        return q;
+    }
+    return NULL;
+}
+
+/* gm_instance_admit under the lock, then release what it restarted on this worker */
+static bool routine_admit(gmi_worker* w, gmi_routine* r) {
+    gmi_routine* reap = NULL;
+    pthread_mutex_lock(&w->h->inst_lock);
+    bool run = gm_instance_admit(w, r, &reap);
+    pthread_mutex_unlock(&w->h->inst_lock);
+    
+    while (reap) {
+        gmi_routine* next = reap->next;
+        routine_release(w, reap);
+        reap = next;
+    }
+    return run;
+}
+
+/* gm_instance_done under the lock, then start the trigger queued behind r */
+static void routine_done(gmi_handle* h, gmi_routine* r) {
+    pthread_mutex_lock(&h->inst_lock);
+    gmi_routine* q = gm_instance_done(r);
+    pthread_mutex_unlock(&h->inst_lock);
+    if (q) sched_start(h, q);
+}
+
+/* add a finished macro invocation to the latency histograms */
+static void latency_record(gmi_worker* w, gmi_routine* r) {
+    if (r->t_event && r->t_listen >= r->t_event) hist_add(&w->lat_kernel, r->t_listen - r->t_event);
+    hist_add(&w->lat_listener, r->t_submit - r->t_listen);
+    hist_add(&w->lat_queue, r->t_start - r->t_submit);
+    if (r->t_output) {
+        hist_add(&w->lat_output, r->t_output - r->t_start);
+        if (r->t_event && r->t_output >= r->t_event) hist_add(&w->lat_total, r->t_output - r->t_event);
+    }
+    hist_add(&w->lat_handler, r->run_ns);
+}
+
+/*
+  flush pending output, and note when the running invocation first got its output out.
+  Invocations that finished with their output still coalesced are recorded now.
+*/
+static void output_flush(gmi_worker* w) {
+    if (!w->out_pending) return;
+    w->h->out->flush(w);
+    COUNT_ADD(w->output_events, w->out_pending);
+    COUNT_ADD(w->output_flushes, 1);
+    w->out_pending = 0;
+    
+    uint64_t now = gmi_now();
+    gmi_routine* r = w->active_handler;
+    if (r && !r->returned && !r->t_output) r->t_output = now;
+    while ((r = w->flush_wait)) {
+        w->flush_wait = r->next;
+        r->t_output = now;
+        latency_record(w, r);
+        routine_free(w->h, r);
+    }
+}
+
+/* an event was handed to the output, flush it unless it is coalesced or flushing is off */
+static inline void output_event(gmi_worker* w) {
+    ++w->out_pending;
+    if (w->flush && !w->h->settings->output_coalesce) output_flush(w);
+}
+
+/* end of a scheduler cycle, everything the handlers injected goes out in one flush */
+static void output_cycle(gmi_worker* w) {
+    if (w->flush) output_flush(w);
+    
+    /* a handler turned flushing off, their output goes out whenever it is flushed */
+    gmi_routine* r;
+    while ((r = w->flush_wait)) {
+        w->flush_wait = r->next;
+        latency_record(w, r);
+        routine_free(w->h, r);
+    }
+}
+
+/* a routine is done, let its macro run again and record or free it */
+static void routine_finish(gmi_worker* w, gmi_routine* r) {
+    if (r->node) routine_done(w->h, r);
+    
+    if (r->node && w->out_pending && w->flush && !r->t_output) {
+        /* recorded by the end of cycle flush, which is when its output goes out */
+        r->next = w->flush_wait;
+        w->flush_wait = r;
+    } else {
+        if (r->node) latency_record(w, r);
+        routine_free(w->h, r);
+    }
+}
+
+/*
+  interpret a compiled sequence from r->pc up to its next sleep, which becomes a plain
+  timer event for gm_wrapper, or to its end. No stack or context switch is involved.
+*/
+static void sequence_run(gmi_worker* w, gmi_routine* r) {
+    gmi_handle* h = w->h;
+    const gmi_op* op = &r->sequence->ops[r->pc];
+    uint64_t t0 = gmi_now(), t1;
+    if (!r->t_start) r->t_start = t0;
+    
+    for (;; ++op) {
+        switch (op->op) {
+        case GMI_OP_KEY:     gmh_key_code(h, op->press, op->a);  continue;
+        case GMI_OP_BUTTON:  gmh_mouse(h, op->press, (unsigned int) op->a); continue;
+        case GMI_OP_MOVE:    gmh_move(h, op->a, op->b);           continue;
+        case GMI_OP_SAVE:    gmh_getmouse(h, &r->sx, &r->sy);     continue;
+        case GMI_OP_RESTORE: gmh_move(h, r->sx, r->sy);           continue;
+        default: break;
+        }
+        break;
+    }
+    
+    t1 = gmi_now();
+    r->run_ns += t1 - t0;
+    if (r->node) atomic_fetch_add_explicit(&r->node->stats.handler_ns, t1 - t0, memory_order_relaxed);
+    
+    if (op->op == GMI_OP_SLEEP) {
+        /* like a handler that sleeps, its output goes out now */
+        if (w->out_pending && w->flush) {
+            output_flush(w);
+            if (!r->t_output) r->t_output = gmi_now();
+        }
+        r->pc = (unsigned int) (op - r->sequence->ops) + 1;
+        chain_register_eventd(w, &gm_wrapper, op->a > 0 ? (uint64_t) op->a * 1000ULL : 1, r);
     } else {
+        routine_finish(w, r);
+    }
+}
+
+/*
+  call a stackless handler (gm_macro.step) up to its next sleep or wait, which only
+  recorded the request, and schedule it like a suspended coroutine
+*/
+static void step_run(gmi_worker* w, gmi_routine* r) {
+    const gm_macro* m = r->node->macro;
+    w->active_handler = r;
+    r->req_sleep_time = 0;
+    r->waiting = false;
+    
+    uint64_t t0 = gmi_now();
+    if (!r->t_start) r->t_start = t0;
+    int more = m->step(r->value, m->arg, &r->state);
+    uint64_t ran = gmi_now() - t0;
+    if (more && w->flush) output_flush(w);
+    w->active_handler = NULL;
+    r->run_ns += ran;
+    atomic_fetch_add_explicit(&r->node->stats.handler_ns, ran, memory_order_relaxed);
+    
+    if (!more) {
+        /* gave up after gmh_wait, unless the latch already opened: then its resume finishes */
+        if (r->waiting && !latch_leave(r)) r->returned = true;
+        else routine_finish(w, r);
+    }
+    else if (!r->waiting)
+        chain_register_eventd(w, &gm_wrapper, r->req_sleep_time ? r->req_sleep_time : 1, r);
+}
+
+/* runs every routine, on the worker that picked it up first (gmi_self) */
+static void gm_wrapper(void* _r) {
+    gmi_routine* r = (gmi_routine*) _r;
+    gmi_handle* h = r->h;
+    gmi_worker* w = gmi_self;
+    
+    if (r->cancelled) {
+        /* pending timer or resume of a restarted invocation */
+        routine_release(w, r);
+        routine_free(h, r);
+        return;
+    }
+    if (r->returned) {
+        routine_finish(w, r);
+        return;
+    }
+    if (r->node && !r->admitted && !routine_admit(w, r))
+        return;
+    r->worker = w;
+    
+    if (r->sequence) {
+        sequence_run(w, r);
+        return;
+    }
+    if (r->node && r->node->macro->step) {
+        step_run(w, r);
+        return;
+    }
+                            
+    w->active_handler = r;
+                        
+    r->req_sleep_time = 0;
+    r->waiting = false;
+    
+    if (r->stack == NULL) {
+        /*
+          First run of this invocation. Default sized invocations start on the
+          worker's spare stack, which they only keep (get promoted to a real
+          coroutine) if they sleep or wait. Handlers and tasks that run to completion
+          hand it straight back, so they never take anything from the stack pool.
+        */
+        size_t size = r->node && r->node->macro->stack_size
+            ? r->node->macro->stack_size : h->stack_size;
+        if (stack_round(size) == stack_round(h->stack_size) && w->spare) {
+            r->stack = w->spare;
+            w->spare = NULL;
+        } else if (!(r->stack = stack_acquire(w, size))) {
+            w->active_handler = NULL;
+            if (r->node) routine_done(h, r);
+            routine_free(h, r);
+            return;
+        }
+        gmi_ctx_make(&r->context, r->stack->base, r->stack->size, &gm_routine, r);
+    }
+    
+    /* run the handler until it sleeps, waits or returns */
+    uint64_t t0 = gmi_now();
+    if (!r->t_start) r->t_start = t0;
+    gmi_ctx_switch(&w->context, &r->context);
+    uint64_t ran = gmi_now() - t0;
+    /* coalesced output goes out before the handler sleeps or waits */
+    if (!r->returned && w->flush) output_flush(w);
+    w->active_handler = NULL;
+    r->run_ns += ran;
+    if (r->node) atomic_fetch_add_explicit(&r->node->stats.handler_ns, ran, memory_order_relaxed);
+
+    if (r->returned) {
         #if DEBUG_MODE
-        printf("end of event, freeing struct wrapper_data (%p)\n", w);
+        printf("end of event, freeing routine (%p)\n", r);
         #endif
-        free(w);
+        
+        gmi_stack* st = r->stack;
+        if (h->settings->stack_debug) {
+            size_t used = stack_measure(st);
+            pthread_mutex_lock(&h->inst_lock);
+            if (r->node ? used > r->node->routine.stack_hwm : used > COUNT_GET(w->stacks_hwm)) {
+                if (r->node) r->node->routine.stack_hwm = used;
+                fprintf(stderr, "macro '%s': stack high-water mark %zu of %zu bytes\n",
+                        r->node ? r->node->macro->key : "(gm_sched)", used, st->size);
+            }
+            pthread_mutex_unlock(&h->inst_lock);
+            if (used > COUNT_GET(w->stacks_hwm)) atomic_store_explicit(&w->stacks_hwm, used, memory_order_relaxed);
+        }
+        if (!w->spare && st->size + sizeof(gmi_stack) == stack_round(h->stack_size)) {
+            if (h->settings->stack_debug) stack_refill(st);
+            w->spare = st;
+        } else
+            stack_release(w, st);
+        
+        /* only now is the stack unused, so the macro may be triggered again */
+        routine_finish(w, r);
+    } else if (!r->waiting) {
+        /* a sleep was requested, so we need to schedule again to continue this context later. */
+        chain_register_eventd(w, &gm_wrapper, r->req_sleep_time, r);
     }
+    /* waiting routines are rescheduled by gmh_latch_open */
 }
 
 static void gm_routine_entry(gmi_handle* h, gm_macro_node* c, int value) {
                     
-    if (c->routine.running) return; /* ignore if the macro is already executing */
-    c->routine.running = true;
-                    
     #if DEBUG_MODE
-    printf("executing macro (%p) for keycode %d\n", c->macro, (int) c->keycode);
+    printf("executing macro (%p) for keycode %d (%s)\n", c->macro, (int) c->keycode, gm_key_name(c->keycode));
     #endif
-                    
-    /* setup new stack and context for this handler */
-    c->routine.req_sleep_time = 0;
-                    
-    getcontext(&c->routine.context);
-                    
-    c->routine.context.uc_link = &h->context;
-    c->routine.context.uc_stack = (stack_t) {
-        .ss_sp = c->routine.stack,
-        .ss_size = sizeof(c->routine.stack)
+    
+    /* sequences only run on press */
+    if (c->macro->sequence && value != 1) return;
+    
+    /* the policy, stack and context are handled by the wrapper, on a worker */
+    atomic_fetch_add(&c->routine.refs, 1);
+    if (c->macro->sequence) atomic_fetch_add(&c->macro->sequence->refs, 1);
+    gmi_routine* r = pool_alloc(&h->routine_pool);
+    *r = (gmi_routine) {
+        .stack = NULL, .h = h, .node = c, .value = value, .returned = false,
+        .sequence = c->macro->sequence, .pc = 0,
+        .t_event = h->event_time, .t_listen = h->listen_time, .t_submit = gmi_now()
     };
-
-    /*
-      TODO: fix this so it works on other versions of libc, currently only works
-      on glibc due to passing non int-sized value to context.
-    */
-    makecontext(&c->routine.context, (void (*)()) gm_routine, 2, value, c);
-
-    struct wrapper_data* w = malloc(sizeof(struct wrapper_data));
-    *w = (struct wrapper_data) { .c = c, .h = h };
                         
     /* wrapper function for executing user code in scheduler (recursive) */
-    chain_register_eventd(h, &gm_wrapper, 0, w);
+    sched_start(h, r);
+}
+
+/* listener epoll keys, device ids start after these */
+#define LISTEN_WAKE    0
+#define LISTEN_HOTPLUG 1
+
+/* true if a macro bound to 'dev' (a full path or last path component) accepts device d */
+static inline bool device_match(const gmi_device* d, const char* dev) {
+    return dev == NULL || !strcmp(dev, d->path) || !strcmp(dev, d->name);
+}
+
+/* advance the sequence automaton on a key press, t in microseconds */
+static void seq_step(gmi_handle* h, gmi_device* d, unsigned int code, uint64_t t) {
+    gmi_seq* q = &h->seq;
+    if (!q->nstates) return;
+    
+    unsigned int st = q->state, i, k;
+    uint64_t last = q->times[(q->pos + GMI_TRIGGER_MAX - 1) % GMI_TRIGGER_MAX];
+    if (st && t - last > q->window[st]) st = 0; /* too slow, start over */
+    st = q->delta[st * q->ncls + q->cls[code]];
+    q->state = st;
+    q->times[q->pos++ % GMI_TRIGGER_MAX] = t;
+    
+    gm_macro_node** c = &q->out[q->out_first[st]];
+    for (i = 0; i < q->out_count[st]; ++i) {
+        /* states shared by several sequences use the largest window, check this one's */
+        for (k = 1; k < c[i]->trigger.ncodes; ++k) {
+            uint64_t a = q->times[(q->pos - k - 1) % GMI_TRIGGER_MAX], b = q->times[(q->pos - k) % GMI_TRIGGER_MAX];
+            if (b - a > c[i]->trigger.window) break;
+        }
+        if (k == c[i]->trigger.ncodes && device_match(d, c[i]->macro->device))
+            gm_routine_entry(h, c[i], 1);
+    }
+}
+
+/*
+  chords trigger with 1 once all of their keys are held, 2 on repeats while they stay
+  held and 0 when the first of them is released
+*/
+static void chord_step(gmi_handle* h, gm_macro_node* c, int value) {
+    if (value == 0) {
+        if (c->trigger.down) {
+            c->trigger.down = false;
+            gm_routine_entry(h, c, 0);
+        }
+    } else if (c->trigger.down) {
+        if (value == 2) gm_routine_entry(h, c, 2);
+    } else if (value == 1) {
+        unsigned int t;
+        for (t = 0; t < c->trigger.ncodes; ++t) {
+            unsigned int code = c->trigger.codes[t];
+            if (!(h->held[code / 64] & (1ULL << (code % 64)))) return;
+        }
+        c->trigger.down = true;
+        gm_routine_entry(h, c, 1);
+    }
+}
+
+/* forget chords whose keys were released while their events were not dispatched */
+static void chord_resync(gmi_handle* h) {
+    gm_macro_node* c;
+    unsigned int t;
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        if (c->trigger.kind != GMI_TRIGGER_CHORD || !c->trigger.down) continue;
+        for (t = 0; t < c->trigger.ncodes; ++t) {
+            unsigned int code = c->trigger.codes[t];
+            if (!(h->held[code / 64] & (1ULL << (code % 64)))) {
+                c->trigger.down = false;
+                break;
+            }
+        }
+    }
+}
+
+/* rebuild the held keys from the open devices after events were lost, dev_lock held */
+static void held_resync(gmi_handle* h) {
+    uint64_t keys[KEY_MAX / 64 + 1];
+    gmi_device* d;
+    size_t t;
+    memset(h->held, 0, sizeof(h->held));
+    for (d = h->devices; d != NULL; d = d->next) {
+        if (d->fd == -1) continue;
+        memset(keys, 0, sizeof(keys));
+        if (ioctl(d->fd, EVIOCGKEY(sizeof(keys)), keys) < 0) continue;
+        for (t = 0; t < sizeof(keys) / sizeof(*keys); ++t)
+            h->held[t] |= keys[t];
+    }
+    h->chords_synced = false;
+}
+
+/*
+  dispatch the key events of one SYN_REPORT frame. Held keys are tracked even while
+  not listening, so chords see releases that happened between gm_stop and gm_start
+*/
+static void listen_frame(gmi_handle* h, gmi_device* d, const struct input_event* frame, size_t n) {
+    size_t t, i;
+    /* the dispatch table is only stable while listening */
+    bool dispatch = h->listening;
+    if (!dispatch) h->chords_synced = false;
+    else if (!h->chords_synced) {
+        chord_resync(h);
+        h->chords_synced = true;
+    }
+    for (t = 0; t < n; ++t) {
+        unsigned int code = frame[t].code;
+        int value = frame[t].value;
+        if (code > KEY_MAX) continue;
+        
+        if (value == 1) h->held[code / 64] |= 1ULL << (code % 64);
+        else if (value == 0) h->held[code / 64] &= ~(1ULL << (code % 64));
+        if (!dispatch) continue;
+        
+        uint64_t us = (uint64_t) frame[t].time.tv_sec * 1000000ULL + (uint64_t) frame[t].time.tv_usec;
+        h->event_time = d->monotonic ? us * 1000ULL : 0;
+        /* every press steps the sequences, keys outside all of them (column 0) start over */
+        if (value == 1) seq_step(h, d, code, us);
+        
+        /* most keys have no macro, reject those on the bitmap */
+        if (!(h->dispatch_mask[code / 64] & (1ULL << (code % 64)))) continue;
+        
+        gm_macro_node** c = &h->dispatch_nodes[h->dispatch[code].first];
+        for (i = 0; i < h->dispatch[code].count; ++i) {
+            if (!device_match(d, c[i]->macro->device)) continue;
+            if (c[i]->trigger.kind == GMI_TRIGGER_CHORD) chord_step(h, c[i], value);
+            else gm_routine_entry(h, c[i], value);
+        }
+    }
+}
+
+/* split a batch of events into SYN_REPORT frames */
+static void listen_events(gmi_handle* h, gmi_device* d, const struct input_event* evs, size_t count) {
+    size_t t;
+    for (t = 0; t < count; ++t) {
+        const struct input_event* ev = &evs[t];
+        if (ev->type == EV_SYN) {
+            if (ev->code == SYN_REPORT) {
+                /* ev.value: 0 release, 1 press, 2 repeat */
+                if (!d->dropped) listen_frame(h, d, d->frame, d->nframe);
+                else held_resync(h); /* releases may have been lost with the dropped events */
+                if (!d->dropped && (d->rel_x || d->rel_y)) pointer_add(h, d->rel_x, d->rel_y);
+                d->nframe = 0;
+                d->rel_x = d->rel_y = 0;
+                d->dropped = false;
+            } else if (ev->code == SYN_DROPPED) {
+                /* the kernel buffer overflowed, this frame is incomplete */
+                d->nframe = 0;
+                d->rel_x = d->rel_y = 0;
+                d->dropped = true;
+                /* motion was lost, the tracked position is only good again after a query */
+                atomic_store(&h->pointer, POINTER_NONE);
+            }
+        } else if (ev->type == EV_REL && h->settings->pointer_track) {
+            if (ev->code == REL_X) d->rel_x += ev->value;
+            else if (ev->code == REL_Y) d->rel_y += ev->value;
+        } else if (ev->type == EV_KEY && !d->dropped) {
+            if (d->nframe == sizeof(d->frame) / sizeof(*d->frame)) {
+                listen_frame(h, d, d->frame, d->nframe);
+                d->nframe = 0;
+            }
+            d->frame[d->nframe++] = *ev;
+        }
+    }
+}
+
+/* open a device and add it to the listener's epoll set, dev_lock held */
+static int device_open(gmi_handle* h, gmi_device* d) {
+    int fd = open(d->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return -1;
+    listen_mask(h, fd);
+    /* timestamp events on the clock the rest of the library uses */
+    int clk = CLOCK_MONOTONIC;
+    d->monotonic = ioctl(fd, EVIOCSCLOCKID, &clk) == 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = d->id };
+    if (epoll_ctl(h->lepfd, EPOLL_CTL_ADD, fd, &ev)) {
+        close(fd);
+        return -1;
+    }
+    d->fd = fd;
+    d->nframe = 0;
+    d->rel_x = d->rel_y = 0;
+    d->dropped = false;
+    #if DEBUG_MODE
+    printf("opened device %s\n", d->path);
+    #endif
+    return 0;
+}
+
+/* close a device, it stays in the list and is reopened when it reappears. dev_lock held */
+static void device_close(gmi_handle* h, gmi_device* d) {
+    if (d->fd == -1) return;
+    epoll_ctl(h->lepfd, EPOLL_CTL_DEL, d->fd, NULL);
+    close(d->fd);
+    d->fd = -1;
+    #if DEBUG_MODE
+    printf("closed device %s\n", d->path);
+    #endif
+}
+
+/* read one batch of events from a device, up to 64 per syscall */
+static void listen_device(gmi_handle* h, uint64_t id) {
+    struct input_event evs[64];
+    gmi_device* d;
+    
+    pthread_mutex_lock(&h->dev_lock);
+    for (d = h->devices; d != NULL && d->id != id; d = d->next);
+    if (d != NULL && d->fd != -1) {
+        ssize_t n = read(d->fd, evs, sizeof(evs));
+        h->listen_time = gmi_now();
+        if (n > 0 && n % sizeof(*evs) == 0)
+            listen_events(h, d, evs, (size_t) n / sizeof(*evs));
+        else if (n != -1 || (errno != EAGAIN && errno != EINTR))
+            device_close(h, d); /* unplugged (ENODEV) or end of file */
+    }
+    pthread_mutex_unlock(&h->dev_lock);
+}
+
+/* (re)open or close devices whose names appeared or vanished in a watched directory */
+static void listen_hotplug(gmi_handle* h) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n = read(h->ifd, buf, sizeof(buf));
+    if (n <= 0) return;
+    
+    pthread_mutex_lock(&h->dev_lock);
+    char* p;
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+        const struct inotify_event* ev = (const struct inotify_event*) p;
+        if (!ev->len) continue;
+        gmi_device* d;
+        for (d = h->devices; d != NULL; d = d->next) {
+            if (d->wd != ev->wd || strcmp(d->name, ev->name)) continue;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                device_close(h, d);
+            else if (d->fd == -1)
+                device_open(h, d); /* may fail until udev has set permissions, IN_ATTRIB retries */
+        }
+    }
+    pthread_mutex_unlock(&h->dev_lock);
+}
+
+static void* listen(void* _h) {
+    gmi_handle* h = (gmi_handle*) _h;
+    struct epoll_event evs[16];
+    
+    while (h->lthread_control) {
+        int n = epoll_wait(h->lepfd, evs, sizeof(evs) / sizeof(*evs), -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait(): %s\n", strerror(errno));
+            break;
+        }
+        int t;
+        for (t = 0; t < n && h->lthread_control; ++t) {
+            switch (evs[t].data.u64) {
+            case LISTEN_WAKE: {
+                uint64_t v;
+                ssize_t ignored = read(h->lefd, &v, sizeof(v));
+                (void) ignored;
+                break;
+            }
+            case LISTEN_HOTPLUG:
+                listen_hotplug(h);
+                break;
+            default:
+                listen_device(h, evs[t].data.u64);
+                break;
+            }
+        }
+    }
+    #if DEBUG_MODE
+    printf("exited listen()\n");
+    #endif
+    return NULL;
+}
+
+/* release an inotify watch unless another device shares its directory, dev_lock held */
+static void device_unwatch(gmi_handle* h, gmi_device* d) {
+    gmi_device* o;
+    if (d->wd == -1) return;
+    for (o = h->devices; o != NULL; o = o->next)
+        if (o != d && o->wd == d->wd) return;
+    inotify_rm_watch(h->ifd, d->wd);
+}
+
+int gm_device_add(gm_handle _h, const char* path) {
+    gmi_handle* h = (gmi_handle*) _h;
+    gmi_device* d, ** end;
+    
+    pthread_mutex_lock(&h->dev_lock);
+    for (end = &h->devices; *end != NULL; end = &(*end)->next) {
+        if (!strcmp((*end)->path, path)) {
+            pthread_mutex_unlock(&h->dev_lock);
+            return 1;
+        }
+    }
+    
+    size_t sz = strlen(path);
+    d = malloc(sizeof(gmi_device) + sz + 1);
+    *d = (gmi_device) { .next = NULL, .path = (char*) (d + 1), .id = h->dev_seq++, .fd = -1, .wd = -1 };
+    memcpy(d->path, path, sz + 1);
+    const char* slash = strrchr(d->path, '/');
+    d->name = slash ? slash + 1 : d->path;
+    
+    /* watch the directory before opening, so a device appearing in between is not missed */
+    if (h->ifd != -1) {
+        char* dir = slash ? strndup(d->path, slash == d->path ? 1 : (size_t) (slash - d->path)) : strdup(".");
+        d->wd = inotify_add_watch(h->ifd, dir, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB);
+        if (d->wd == -1) fprintf(stderr, "inotify_add_watch(): %s: %s\n", dir, strerror(errno));
+        free(dir);
+    }
+    
+    /* a missing device is kept, and opened once it shows up, if its directory is watched */
+    int err = device_open(h, d) ? errno : 0;
+    if (err && (err != ENOENT || d->wd == -1)) {
+        fprintf(stderr, "open(): %s: %s\n", path, strerror(err));
+        device_unwatch(h, d);
+        free(d);
+        pthread_mutex_unlock(&h->dev_lock);
+        return 2;
+    }
+    *end = d;
+    pthread_mutex_unlock(&h->dev_lock);
+    return 0;
+}
+
+int gm_device_remove(gm_handle _h, const char* path) {
+    gmi_handle* h = (gmi_handle*) _h;
+    gmi_device** c;
+    
+    pthread_mutex_lock(&h->dev_lock);
+    for (c = &h->devices; *c != NULL; c = &(*c)->next) {
+        if (!strcmp((*c)->path, path)) {
+            gmi_device* d = *c;
+            *c = d->next;
+            device_close(h, d);
+            device_unwatch(h, d);
+            free(d);
+            pthread_mutex_unlock(&h->dev_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&h->dev_lock);
+    return 1;
 }
 
-static void* listen(void* _h) {
+    
+/* schedules a task: a routine without a macro, which only gets its own stack if it yields */
+void gm_sched(gm_handle _h, void (*f)(void* udata), void* udata) {
     gmi_handle* h = (gmi_handle*) _h;
     
-    struct input_event ev;
-    ssize_t n;
+    gmi_routine* r = pool_alloc(&h->routine_pool);
+    *r = (gmi_routine) { .stack = NULL, .h = h, .node = NULL, .task = f, .arg = udata, .returned = false };
+    
+    /* immediately start execution */
+    sched_start(h, r);
+}
 
-    if ((h->fd = open(h->dev, O_RDONLY)) == -1) {
-        fprintf(stderr, "open(): %s\n", strerror(errno));
-        return NULL;
+gm_sequence gm_sequence_compile(gm_handle h, const gm_step* steps, size_t n) {
+    size_t t, len = 1;
+    for (t = 0; t < n; ++t) {
+        const gm_step* st = &steps[t];
+        if (st->op < GM_STEP_KEY || st->op > GM_STEP_RESTORE || (st->op == GM_STEP_KEY && !st->key))
+            return NULL;
+        len += (st->op == GM_STEP_KEY || st->op == GM_STEP_BUTTON) && st->press == 2 ? 2 : 1;
     }
-
     
-    while (h->lthread_control) {
-        n = read(h->fd, &ev, sizeof(ev));
-        if (!h->lthread_control) break;
-        if (n == (ssize_t) -1) { 
-            if (errno == EINTR) continue;
-            else break;
-        } else if (n != sizeof(ev)) {
-            errno = EIO;
+    gmi_sequence* s = malloc(sizeof(gmi_sequence) + len * sizeof(gmi_op));
+    gmi_op* o = s->ops;
+    s->len = len;
+    s->refs = 1;
+    for (t = 0; t < n; ++t) {
+        const gm_step* st = &steps[t];
+        switch (st->op) {
+        case GM_STEP_KEY:
+        case GM_STEP_BUTTON: {
+            gmi_op p = {
+                .op = st->op == GM_STEP_KEY ? GMI_OP_KEY : GMI_OP_BUTTON,
+                .a = st->op == GM_STEP_KEY ? gm_key_resolve(h, st->key) : st->button
+            };
+            /* a tap is a press and a release */
+            if (st->press == 2) {
+                p.press = 1;
+                *o++ = p;
+                p.press = 0;
+            } else p.press = st->press ? 1 : 0;
+            *o++ = p;
             break;
         }
-        /* ev.value: 0 release, 1 press, 2 repeat */
-        if (h->listening && ev.type == EV_KEY) {
-            /*
-              We have some lightweight coroutining going on here, we provide
-              time for other events in the event chain to execute while
-              gmh_sleep is called.
-            */
-
-            /* cycle though macro chain */
-            gm_macro_node* c;
-            for (c = h->macro_chain; c != NULL; c = c->next) {
-                /* if we kind a matching keycode, execute */
-                if (ev.code == c->keycode) {
-                    gm_routine_entry(h, c, ev.value);
-                }
-            }
+        case GM_STEP_MOVE:
+            *o++ = (gmi_op) { .op = GMI_OP_MOVE, .a = st->x, .b = st->y };
+            break;
+        case GM_STEP_SLEEP:
+            *o++ = (gmi_op) { .op = GMI_OP_SLEEP, .a = st->us > INT32_MAX ? INT32_MAX : (int32_t) st->us };
+            break;
+        case GM_STEP_SAVE:
+            *o++ = (gmi_op) { .op = GMI_OP_SAVE };
+            break;
+        case GM_STEP_RESTORE:
+            *o++ = (gmi_op) { .op = GMI_OP_RESTORE };
+            break;
         }
     }
-    #if DEBUG_MODE
-    printf("exited listen()\n");
-    #endif
-    return NULL;
+    *o = (gmi_op) { .op = GMI_OP_END };
+    return s;
+}
+
+/* invocations still running it keep it until they end */
+void gm_sequence_free(gm_sequence s) {
+    sequence_put(s);
 }
 
+void gm_sequence_run(gm_handle _h, gm_sequence s) {
+    gmi_handle* h = (gmi_handle*) _h;
     
-struct gm_pass_data {
-    void (*f)(void* udata);
-    void* udata;
-    gm_macro_node* node;
-    gmi_handle* h;
-};
+    atomic_fetch_add(&s->refs, 1);
+    gmi_routine* r = pool_alloc(&h->routine_pool);
+    *r = (gmi_routine) { .stack = NULL, .h = h, .node = NULL, .sequence = s, .pc = 0, .returned = false };
+    sched_start(h, r);
+}
 
-static void gm_sched_wrapper(int ignored, void* _pd) {
-    struct gm_pass_data* d = (struct gm_pass_data*) _pd;
-                    
-    d->f(d->udata);
-                    
-    /*
-      cleanup everything after this is finished executing. We have
-      to re-schedule this so it happens in the main context, so we're
-      not wiping our own stack.
-    */
-    void _fn(void* _pd) {
-        struct gm_pass_data* d = (struct gm_pass_data*) _pd;
-        free(d->node->macro);
-        free(d->node);
-        free(d);
+static void chain_register_event(gmi_heap* chain, lnode* new);
+
+/* wake a worker so it re-evaluates the earliest deadline */
+static void sched_wakeup(gmi_worker* w) {
+    if (w->efd != -1) {
+        uint64_t v = 1;
+        while (write(w->efd, &v, sizeof(v)) == -1 && errno == EINTR);
+    } else {
+        pthread_mutex_lock(&w->chain_lock);
+        pthread_cond_signal(&w->chain_cond);
+        pthread_mutex_unlock(&w->chain_lock);
     }
-                    
-    chain_register_eventd(d->h, &_fn, 0, d);
 }
 
-/* registers a dummy macro and immediately executes it */
-void gm_sched(gm_handle _h, void (*f)(void* udata), void* udata) {
-    gmi_handle* h = (gmi_handle*) _h;
+/* submit event with delay (nanoseconds) to a worker, never blocks */
+static void chain_register_eventd(gmi_worker* w, void (*f) (void*), uint64_t delay, void* arg) {
+    #if DEBUG_MODE
+    printf("reg: %llu\n", (unsigned long long) delay);
+    #endif
     
-    struct gm_macro_node* new = malloc(sizeof(struct gm_macro_node));
+    /* once pushed, the node may already be run and freed by the worker */
+    uint64_t target = delay ? gmi_now() + delay : 0;
+    lnode* new = pool_alloc(&w->h->lnode_pool);
+    *new = (lnode) { .f = f, .target = target, .arg = arg };
     
-    new->keycode = 0;
-    new->macro = malloc(sizeof(gm_macro));
+    new->next = atomic_load(&w->submit);
+    while (!atomic_compare_exchange_weak(&w->submit, &new->next, new));
     
-    struct gm_pass_data* pd = malloc(sizeof(struct gm_pass_data));
-    *pd = (struct gm_pass_data) {
-        .f = f, .udata = udata, .node = new, .h = h
-    };
+    /*
+      The worker sets sched_idle before it re-checks the queue and blocks, so
+      either it sees our node or we see the flag. If it is blocked on an earlier
+      deadline it will find our node when it wakes up anyway.
+    */
+    if (atomic_load(&w->sched_idle) && target < atomic_load(&w->sched_deadline))
+        sched_wakeup(w);
+}
 
-    /* dummy macro routine */
-    *(new->macro) = (gm_macro) {
-        .arg = pd,
-        .f = gm_sched_wrapper,
-        .key = ""
-    };
+/*
+  hand a routine that has not run yet to a worker. With more than one, it goes on the
+  fresh queue of its macro's worker (or the calling worker for tasks), so triggers of a
+  macro are admitted in order. If that one is busy, an idle worker that could take it
+  (see fresh_steal) is woken instead.
+*/
+static void sched_start(gmi_handle* h, gmi_routine* r) {
+    if (h->nworkers == 1) {
+        chain_register_eventd(h->workers, &gm_wrapper, 0, r);
+        return;
+    }
+    
+    gmi_worker* w;
+    if (r->node) w = &h->workers[r->node->worker];
+    else if (gmi_self && gmi_self->h == h) w = gmi_self;
+    else w = &h->workers[atomic_fetch_add(&h->next_worker, 1) % h->nworkers];
+    
+    lnode* new = pool_alloc(&h->lnode_pool);
+    *new = (lnode) { .next = NULL, .f = &gm_wrapper, .target = 0, .arg = r };
+    pthread_mutex_lock(&w->fresh_lock);
+    *w->fresh_end = new;
+    w->fresh_end = &new->next;
+    atomic_fetch_add(&w->nfresh, 1);
+    pthread_mutex_unlock(&w->fresh_lock);
+    
+    if (atomic_load(&w->sched_idle)) {
+        sched_wakeup(w);
+        return;
+    }
+    unsigned int t;
+    for (t = 1; t < h->nworkers; ++t) {
+        gmi_worker* v = &h->workers[(w->id + t) % h->nworkers];
+        if (atomic_load(&v->sched_idle) && atomic_load(&v->sched_deadline) == UINT64_MAX) {
+            sched_wakeup(v);
+            return;
+        }
+    }
+}
 
-    /* this isn't part of any macro chain */
-    new->next = NULL;
+/*
+  take the oldest routine from the fresh queue of 'v' to run on 'w'. Macro invocations
+  are admitted while the queue is still locked, in the order they were triggered, so
+  the ones their policy drops or queues are skipped here.
+*/
+static lnode* fresh_take(gmi_worker* w, gmi_worker* v) {
+    gmi_handle* h = w->h;
+    gmi_routine* reap = NULL;
+    lnode* c;
     
-    new->routine.running = false;
+    pthread_mutex_lock(&v->fresh_lock);
+    while ((c = v->fresh)) {
+        if (!(v->fresh = c->next)) v->fresh_end = &v->fresh;
+        atomic_fetch_sub(&v->nfresh, 1);
+        
+        gmi_routine* r = c->arg;
+        if (!r->node || r->admitted) break;
+        pthread_mutex_lock(&h->inst_lock);
+        bool run = gm_instance_admit(w, r, &reap);
+        pthread_mutex_unlock(&h->inst_lock);
+        if (run) break;
+        pool_free(&h->lnode_pool, c);
+    }
+    pthread_mutex_unlock(&v->fresh_lock);
     
-    /* immediately start execution */
-    gm_routine_entry(h, new, 0);
+    while (reap) {
+        gmi_routine* next = reap->next;
+        routine_release(w, reap);
+        reap = next;
+    }
+    if (c) c->next = NULL;
+    return c;
+}
+
+/*
+  an idle worker takes a routine some other worker has not got to yet. Not while it has
+  timers of its own: the routine could run past them, and they would be late.
+*/
+static lnode* fresh_steal(gmi_worker* w) {
+    gmi_handle* h = w->h;
+    unsigned int t;
+    if (w->chain.len) return NULL;
+    for (t = 1; t < h->nworkers; ++t) {
+        gmi_worker* v = &h->workers[(w->id + t) % h->nworkers];
+        lnode* c;
+        if (atomic_load(&v->nfresh) && (c = fresh_take(w, v))) {
+            COUNT_ADD(w->stolen, 1);
+            return c;
+        }
+    }
+    return NULL;
 }
 
-static void chain_register_event(lnode** chain_p, void (*f) (void*), long target, void* arg);
+/* whether there are routines this worker should start, or take (fresh_steal) */
+static bool fresh_pending(gmi_worker* w) {
+    gmi_handle* h = w->h;
+    unsigned int t;
+    if (atomic_load(&w->nfresh)) return true;
+    if (w->chain.len) return false;
+    for (t = 0; t < h->nworkers; ++t)
+        if (atomic_load(&h->workers[t].nfresh)) return true;
+    return false;
+}
 
-/* register event with delay, locking on main chain */
-static void chain_register_eventd(gmi_handle* h, void (*f) (void*), long delay, void* arg) {
-    #if DEBUG_MODE
-    printf("reg: %d\n", (int) delay);
-    #endif
-    
-    pthread_mutex_lock(&h->chain_lock);
-    if (delay) {
-        struct timespec tm;
-        clock_gettime(CLOCK_REALTIME, &tm);
-        long tml = ((long) (tm.tv_sec * 1000L)) + (tm.tv_nsec / (1000L * 1000L));
-        chain_register_event(&h->chain, f, tml + delay, arg);
-    } else {
-        chain_register_event(&h->chain, f, 0, arg);
+/* move every submitted event into the chain, preserving submission order */
+static void chain_drain_submitted(gmi_worker* w) {
+    lnode* c = atomic_exchange(&w->submit, NULL);
+    lnode* rev = NULL;
+    while (c != NULL) { /* the queue is a stack, reverse it */
+        lnode* tmp = c->next;
+        c->next = rev;
+        rev = c;
+        c = tmp;
+    }
+    while (rev != NULL) {
+        lnode* tmp = rev->next;
+        chain_register_event(&w->chain, rev);
+        rev = tmp;
     }
-    pthread_mutex_unlock(&h->chain_lock);
-    pthread_cond_signal(&h->chain_cond);
 }
 
 /*
-static void chain_debug(gmi_handle* h) {
+static void chain_debug(gmi_worker* w) {
     printf("dumping chain...\n");
-    pthread_mutex_lock(&h->chain_lock);
-    int i = 0;
-    lnode* c;
-    for (c = h->chain; c != NULL; c = c->next) {
-        printf("%d: [ f: %p, target: %ld]\n", i, c->f, c->target);
-        ++i;
+    pthread_mutex_lock(&w->chain_lock);
+    size_t t;
+    for (t = 0; t < w->chain.len; ++t) {
+        lnode* c = w->chain.nodes[t];
+        printf("%d: [ f: %p, target: %llu, seq: %llu]\n", (int) t, c->f,
+               (unsigned long long) c->target, (unsigned long long) c->seq);
     }
-    printf("sz: %d\n", i);
-    pthread_mutex_unlock(&h->chain_lock);
+    printf("sz: %d\n", (int) w->chain.len);
+    pthread_mutex_unlock(&w->chain_lock);
 }
 */
 
-/* register event */
-static void chain_register_event(lnode** chain_p, void (*f) (void*), long target, void* arg) {
-    /* find end */
-    lnode* end = *chain_p;
-    while (end != NULL && end->next != NULL)
-        end = end->next;
+/* heap ordering: earlier target first, insertion order for equal targets */
+static inline bool chain_before(const lnode* a, const lnode* b) {
+    return a->target < b->target || (a->target == b->target && a->seq < b->seq);
+}
 
-    #if DEBUG_MODE
-    if (end == NULL)
-        printf("registering at head\n");
-    else 
-        printf("appending to chain\n");
-    #endif
-    
-    lnode** new = end == NULL ? chain_p : &(end->next); /* handle NULL chain */
+/* register event, O(log n) */
+static void chain_register_event(gmi_heap* chain, lnode* new) {
+    if (chain->len == chain->cap) {
+        chain->cap = chain->cap ? chain->cap * 2 : 64;
+        chain->nodes = realloc(chain->nodes, chain->cap * sizeof(lnode*));
+    }
     
-    *new = malloc(sizeof(struct lnode));
-    (*new)->f = f;
+    new->next = NULL;
+    new->seq = chain->seq++;
 
-    (*new)->target = target;
-    (*new)->arg = arg;
-    (*new)->next = NULL;
+    /* sift up */
+    size_t i = chain->len++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!chain_before(new, chain->nodes[parent]))
+            break;
+        chain->nodes[i] = chain->nodes[parent];
+        i = parent;
+    }
+    chain->nodes[i] = new;
 }
 
-/* cycle through chain, returning true if there is an event needing execution */
-static bool chain_contains_events(lnode* chain, long* wait) {
-    lnode* c;
-    *wait = -1;
-    for (c = chain; c != NULL; c = c->next) {
-        
-        if (c->target == 0)
-            return true;
-        struct timespec tm;
-        clock_gettime(CLOCK_REALTIME, &tm);
-        long tml = ((long) (tm.tv_sec * 1000L)) + (tm.tv_nsec / (1000L * 1000L));
-        if (c->target <= tml) {
-            return true;
-        } else {
-            /* pass the amount of time we should wait until the next event */
-            if (*wait < c->target - tml)
-                *wait = c->target - tml;
-        }
+/* remove the earliest event from the chain, O(log n) */
+static lnode* chain_pop(gmi_heap* chain) {
+    lnode* top = chain->nodes[0];
+    lnode* last = chain->nodes[--chain->len];
+    
+    /* sift down */
+    size_t i = 0;
+    for (;;) {
+        size_t child = i * 2 + 1;
+        if (child >= chain->len)
+            break;
+        if (child + 1 < chain->len && chain_before(chain->nodes[child + 1], chain->nodes[child]))
+            ++child;
+        if (!chain_before(chain->nodes[child], last))
+            break;
+        chain->nodes[i] = chain->nodes[child];
+        i = child;
     }
-    return false;
+    if (chain->len)
+        chain->nodes[i] = last;
+    return top;
 }
 
-/* copy events that aren't ready to be executed to a new list */
-static void chain_copy_waiting(lnode** chain_dest, lnode* source) {
-    lnode* c;
-    for (c = source; c != NULL; c = c->next) {
+/*
+  move every event that is due at 'now' into a ready list (in execution order),
+  returning NULL if nothing is due. Pending events stay in the heap untouched.
+*/
+static lnode* chain_take_ready(gmi_heap* chain, uint64_t now) {
+    lnode* head = NULL, ** tail = &head;
+    while (chain->len && chain->nodes[0]->target <= now) {
+        lnode* c = chain_pop(chain);
+        c->next = NULL;
+        *tail = c;
+        tail = &c->next;
+    }
+    return head;
+}
 
+/* execute and free a ready list */
+static void chain_cycle_events(gmi_worker* w, lnode* ready) {
+    lnode* c;
+    for (c = ready; c != NULL;) {
+        
         #if DEBUG_MODE
-        printf("copy iter: %p\n", c);
+        printf("exec (target: %llu): %p\n", (unsigned long long) c->target, c->f);
         #endif
         
-        if (c->target == 0)
-            continue;
-        struct timespec tm;
-        clock_gettime(CLOCK_REALTIME, &tm);
-        long tml = ((long) (tm.tv_sec * 1000L)) + (tm.tv_nsec / (1000L * 1000L));
-        if (c->target > tml) {
-            #if DEBUG_MODE
-            printf("copying pending event: %p\n", c);
-            #endif
-            chain_register_event(chain_dest, c->f, c->target, c->arg);
-        }
+        c->f(c->arg);
+        
+        lnode* tmp = c;
+        c = c->next;
+        pool_free(&w->h->lnode_pool, tmp);
     }
 }
 
-/* cycle through chain, executing pending events and purging them from the chain */
-/* sweep - free the entire chain instead of purging individual nodes */
-static bool chain_cycle_events(lnode** chain_p, bool sweep) {
-    void* tofree = NULL;
-    lnode* prev = NULL;
+/*
+  start what was on our fresh queue at the start of this call, one routine at a time
+  so that idle workers can take the rest while one of them runs long
+*/
+static void fresh_cycle(gmi_worker* w) {
+    size_t n = atomic_load(&w->nfresh);
     lnode* c;
-    for (c = *chain_p; c != NULL; c = c->next) {
+    while (n-- && (c = fresh_take(w, w)))
+        chain_cycle_events(w, c);
+}
 
-        #if DEBUG_MODE
-        printf("iter: %p\n", c);
-        #endif
-        
-        /* if we needed to free a node on the last iteration, do it now */
-        if (tofree) {
-            free(tofree);
-            tofree = NULL;
-        }
-        
-        struct timespec tm;
-        long tml;
-        
-        if (c->target == 0) {
-            
-            #if DEBUG_MODE
-            printf("exec (inst): %p\n", c->f);
-            #endif
-            
-            c->f(c->arg);
-            goto purge;
-        }
-        clock_gettime(CLOCK_REALTIME, &tm);
-        tml = ((long) (tm.tv_sec * 1000L)) + (tm.tv_nsec / (1000L * 1000L));
-        if (c->target <= tml) {
-            
-            #if DEBUG_MODE
-            printf("exec (target: %ld, now: %ld): %p\n", c->target, tml, c->f);
-            #endif
-            
-            c->f(c->arg);
-            
-            /*
-              purge the node. We free on the next iteration,
-              since we still need to read from the node
-            */
-        purge:
-            if (sweep) continue;
-            if (prev != NULL) {
-                prev->next = c->next; /* remove the node and link the previous to the next */
-                tofree = c;
-            } else {
-                *chain_p = c->next; /* reassign the start of the list */
-                tofree = c;
-            }
+/*
+  block on the timerfd until the absolute CLOCK_MONOTONIC 'target' (0 to wait
+  indefinitely), or until the eventfd is written to. Called without the chain lock.
+*/
+static void sched_wait_timerfd(gmi_worker* w, uint64_t target) {
+    struct itimerspec its = {
+        .it_interval = { 0, 0 },
+        .it_value = {
+            .tv_sec  = target / 1000000000ULL,
+            .tv_nsec = target % 1000000000ULL
         }
-        prev = c; /* store previous node */
-    }
+    };
+    timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
     
-    if (tofree) {
-        free(tofree);
-        tofree = NULL;
-    }
+    struct epoll_event evs[3];
+    int n = epoll_wait(w->epfd, evs, 3, -1);
     
-    if (sweep) {
-        for (c = *chain_p; c != NULL;) {
-            lnode* tmp = c;
-            c = c->next;
-            free(tmp);
+    /* drain whichever fds fired, both are non-blocking; X events are read by output_events */
+    int t;
+    for (t = 0; t < n; ++t) {
+        uint64_t v;
+        if (evs[t].data.fd == w->xfd) {
+            w->x_ready = true;
+            continue;
         }
-        *chain_p = NULL;
+        ssize_t ignored = read(evs[t].data.fd, &v, sizeof(v));
+        (void) ignored;
+    }
+}
+
+/* empty key table with mask + 1 slots */
+static gmi_key_table* key_table_new(size_t mask, gmi_key_table* prev) {
+    gmi_key_table* kt = malloc(sizeof(gmi_key_table) + (mask + 1) * sizeof(*kt->slots));
+    kt->prev = prev;
+    kt->mask = mask;
+    size_t t;
+    for (t = 0; t <= mask; ++t)
+        atomic_init(&kt->slots[t], -1);
+    return kt;
+}
+
+/* cache entry of an interned key id */
+static inline gmi_key* key_at(gmi_handle* h, int k) {
+    return &h->key_chunks[k / GMI_KEY_CHUNK][k % GMI_KEY_CHUNK];
+}
+
+/* handle what arrived on the output's connection, a keyboard mapping change makes every cached keycode stale */
+static void output_events(gmi_worker* w, int read) {
+    gmi_handle* h = w->h;
+    w->x_ready = false;
+    if (h->out->events(w, read)) {
+        atomic_fetch_add(&h->key_gen, 1);
     }
-    return false;
 }
 
 static void* gm_sched_entry(void* arg) {
-    gmi_handle* h = (gmi_handle*) arg;
+    gmi_worker* w = (gmi_worker*) arg;
+    gmi_handle* h = w->h;
+    gmi_self = w;
+
+    /* the default 50us timer slack would dominate timerfd wakeup precision */
+    if (w->tfd != -1) prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+    
     while (h->lthread_control) {
-        /* we're operating on the main chain, we need to lock it */
-        pthread_mutex_lock(&h->chain_lock);
-
-        long wait;
-        /* wait for wakeup if the chain is empty */
-        while (!chain_contains_events(h->chain, &wait)) {
-            struct timeval tv;
-            struct timespec ts;
+        chain_drain_submitted(w);
+
+        uint64_t now = gmi_now();
+        lnode* ready;
+        /* wait for wakeup if nothing is due, and there is nothing to start or take from others */
+        while (!(ready = chain_take_ready(&w->chain, now)) && !atomic_load(&w->nfresh)
+               && !(h->nworkers > 1 && (ready = fresh_steal(w)))) {
+            uint64_t target = w->chain.len ? w->chain.nodes[0]->target : 0;
             
-            gettimeofday(&tv, NULL);
-
-            /* wait until the next event, or just the default interval if there are no events */
-            long delay = wait > 0 ? wait : h->settings->sched_intval;
+            /* publish what we are about to block on, then check for late submissions */
+            atomic_store(&w->sched_deadline, target ? target : UINT64_MAX);
+            atomic_store(&w->sched_idle, true);
             
-            ts.tv_sec = time(NULL) + delay / 1000;
-            ts.tv_nsec = tv.tv_usec * 1000 + 1000 * 1000 * (delay % 1000);
-            ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
-            ts.tv_nsec %= (1000 * 1000 * 1000);
+            if (w->tfd != -1) {
+                /* the eventfd keeps wakeups pending, so no lock is needed */
+                if (atomic_load(&w->submit) == NULL && !fresh_pending(w))
+                    sched_wait_timerfd(w, target);
+            } else {
+                /* wait until the next event, or just the default interval if there are no events */
+                if (!target)
+                    target = now + (uint64_t) h->settings->sched_intval * 1000000ULL;
+                
+                struct timespec ts = {
+                    .tv_sec  = target / 1000000000ULL,
+                    .tv_nsec = target % 1000000000ULL
+                };
             
-            pthread_cond_timedwait(&h->chain_cond, &h->chain_lock, &ts);
-            if (!h->lthread_control) {
-                pthread_mutex_unlock(&h->chain_lock);
-                return NULL;
+                int timedout = 0;
+                pthread_mutex_lock(&w->chain_lock);
+                if (atomic_load(&w->submit) == NULL && !fresh_pending(w) && h->lthread_control)
+                    timedout = pthread_cond_timedwait(&w->chain_cond, &w->chain_lock, &ts) == ETIMEDOUT;
+                pthread_mutex_unlock(&w->chain_lock);
+                /* no fd to wait on here, look for X events whenever the wait times out */
+                w->x_ready = timedout;
             }
-            #undef DELAY
+            atomic_store(&w->sched_idle, false);
+            
+            if (!h->lthread_control)
+                return NULL;
+            
+            if (w->x_ready) output_events(w, 1);
+            
+            chain_drain_submitted(w);
+            now = gmi_now();
         }
-        lnode* localchain = h->chain;
-        h->chain = NULL;
-        chain_copy_waiting(&h->chain, localchain); /* copy over events that won't be executed this cycle */
-
-        /* we will be operating on a local chain now, so we can unlock */
-        pthread_mutex_unlock(&h->chain_lock);
         
-        chain_cycle_events(&localchain, true); /* cycle events and free the entire chain */
+        chain_cycle_events(w, ready); /* execute events and free the ready list */
+        fresh_cycle(w);
+        output_cycle(w);
+        
+        /* replies read by handlers may have queued events without the fd becoming readable */
+        output_events(w, 0);
     }
     return NULL;
 }
 
-static void gm_emptyhandler(int ignored) {}
+/* set up a worker's wakeup, falling back to the condition variable without timerfd */
+static void worker_init(gmi_handle* h, gmi_worker* w, unsigned int id) {
+    *w = (gmi_worker) {
+        .h           = h,
+        .id          = id,
+        .chain_lock  = PTHREAD_MUTEX_INITIALIZER,
+        .chain       = { .nodes = NULL, .len = 0, .cap = 0, .seq = 0 },
+        .submit      = NULL,
+        .sched_idle  = false,
+        .sched_deadline = UINT64_MAX,
+        .tfd         = -1,
+        .efd         = -1,
+        .epfd        = -1,
+        .fresh_lock  = PTHREAD_MUTEX_INITIALIZER,
+        .fresh       = NULL,
+        .nfresh      = 0,
+        .flush       = true,
+        .display     = NULL,
+        .xfd         = -1,
+        .x_ready     = false,
+        .spare       = NULL,
+        .stacks      = NULL,
+        .pointer_sync = 0
+    };
+    w->fresh_end = &w->fresh;
+
+    /* scheduler deadlines are absolute CLOCK_MONOTONIC times */
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->chain_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    if (h->settings->sched_timerfd) {
+        w->tfd  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        w->efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        
+        struct epoll_event tev = { .events = EPOLLIN, .data.fd = w->tfd };
+        struct epoll_event eev = { .events = EPOLLIN, .data.fd = w->efd };
+        
+        if (w->tfd == -1 || w->efd == -1 || w->epfd == -1
+            || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &tev)
+            || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &eev)) {
+            /* fall back to the condition variable */
+            fprintf(stderr, "timerfd scheduler unavailable: %s\n", strerror(errno));
+            if (w->tfd  != -1) close(w->tfd);
+            if (w->efd  != -1) close(w->efd);
+            if (w->epfd != -1) close(w->epfd);
+            w->tfd = w->efd = w->epfd = -1;
+        }
+    }
+}
+
+/* open the worker's output connection, returns non-zero if it is unavailable */
+static int worker_open(gmi_worker* w) {
+    gmi_handle* h = w->h;
+    if (h->out->xlib && !w->display) w->display = XOpenDisplay(NULL);
+    if (h->out->open(w)) return 1;
+    
+    /* watch the output's connection for replies and MappingNotify, the condvar scheduler polls it */
+    struct epoll_event xev = { .events = EPOLLIN, .data.fd = w->xfd };
+    if (w->xfd != -1 && (w->epfd == -1 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->xfd, &xev)))
+        w->xfd = -1;
+    return 0;
+}
+
+/* release what a stopped worker holds */
+static void worker_close(gmi_worker* w) {
+    gmi_handle* h = w->h;
+    if (w->tfd != -1) {
+        close(w->tfd);
+        close(w->efd);
+        close(w->epfd);
+    }
+    
+    /* release events that never ran */
+    chain_drain_submitted(w);
+    while (w->chain.len)
+        pool_free(&h->lnode_pool, chain_pop(&w->chain));
+    free(w->chain.nodes);
+    while (w->fresh) {
+        lnode* c = w->fresh;
+        w->fresh = c->next;
+        pool_free(&h->lnode_pool, c);
+    }
+    
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (w->spare) stack_release(w, w->spare);
+    while (w->stacks) {
+        gmi_stack* st = w->stacks;
+        w->stacks = st->next;
+        munmap(st->base - page, st->size + sizeof(gmi_stack) + page);
+    }
+    
+    h->out->close(w);
+    if (w->display) XCloseDisplay(w->display);
+    pthread_cond_destroy(&w->chain_cond);
+}
 
 gm_handle gm_init(const char* devpath, const gm_settings* settings) {
 
@@ -606,85 +2393,170 @@ gm_handle gm_init(const char* devpath, const gm_settings* settings) {
 
     gmi_handle* h = malloc(sizeof(gmi_handle));
     *h = (gmi_handle) {
-        .dev         = devpath,
         .active      = NULL,
-        .chain_cond  = PTHREAD_COND_INITIALIZER,
-        .chain_lock  = PTHREAD_MUTEX_INITIALIZER,
-        .chain       = NULL,
+        .inst_lock   = PTHREAD_MUTEX_INITIALIZER,
         .macro_chain = NULL,
-        .display     = NULL,
+        .dispatch_nodes = NULL,
+        .seq         = { .delta = NULL, .window = NULL, .out_first = NULL, .out_count = NULL, .out = NULL },
+        .devices     = NULL,
+        .dev_lock    = PTHREAD_MUTEX_INITIALIZER,
+        .dev_seq     = LISTEN_HOTPLUG + 1,
+        .pointer     = POINTER_NONE,
+        .key_lock    = PTHREAD_MUTEX_INITIALIZER,
+        .key_chunks  = { NULL },
+        .keys_len    = 0,
+        .key_table   = NULL,
+        .key_gen     = 1,
         .listening   = false,
-        .flush       = true,
-        .sa = { .sa_handler = &gm_emptyhandler },
+        .llock       = PTHREAD_MUTEX_INITIALIZER,
         .settings = settings ? settings : &gm_default_settings
     };
 
-    sigemptyset(&h->sa.sa_mask);
-    
-    sigaction(SIGUSR1, &h->sa, NULL);
-    
-    if (!(h->display = XOpenDisplay(NULL))) {
-        fprintf(stderr, "failed to find display (NULL)\n");
+    long nw = h->settings->sched_workers > 0 ? h->settings->sched_workers : 1;
+    h->workers = malloc((size_t) nw * sizeof(gmi_worker));
+    h->nworkers = (unsigned int) nw;
+    unsigned int t;
+    for (t = 0; t < h->nworkers; ++t)
+        worker_init(h, &h->workers[t], t);
+
+    /* zero filled settings (older callers) get the defaults */
+    h->stack_size = h->settings->stack_size > 0
+        ? (size_t) h->settings->stack_size : (size_t) gm_default_settings.stack_size;
+    h->stack_cache = h->settings->stack_cache == 0 ? (size_t) gm_default_settings.stack_cache
+        : h->settings->stack_cache > 0 ? (size_t) h->settings->stack_cache : 0;
+    h->instance_limit = (unsigned int) (h->settings->instance_limit > 0
+        ? h->settings->instance_limit : gm_default_settings.instance_limit);
+    h->sequence_window = (uint64_t) (h->settings->sequence_window > 0
+        ? h->settings->sequence_window : gm_default_settings.sequence_window) * 1000ULL;
+
+    size_t pcap = h->settings->pool_size > 0 ? (size_t) h->settings->pool_size : 0;
+    pool_init(&h->lnode_pool,   sizeof(struct lnode),  pcap);
+    pool_init(&h->routine_pool, sizeof(gmi_routine),   pcap);
+
+    /* listener: one epoll set for every device, a wakeup eventfd and the hotplug watch */
+    h->lepfd = epoll_create1(EPOLL_CLOEXEC);
+    h->lefd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event lev = { .events = EPOLLIN, .data.u64 = LISTEN_WAKE };
+    if (h->lepfd == -1 || h->lefd == -1 || epoll_ctl(h->lepfd, EPOLL_CTL_ADD, h->lefd, &lev)) {
+        fprintf(stderr, "listener epoll setup failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    h->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    lev = (struct epoll_event) { .events = EPOLLIN, .data.u64 = LISTEN_HOTPLUG };
+    if (h->ifd != -1 && epoll_ctl(h->lepfd, EPOLL_CTL_ADD, h->ifd, &lev)) {
+        close(h->ifd);
+        h->ifd = -1;
+    }
+    if (h->ifd == -1)
+        fprintf(stderr, "device hotplug unavailable: %s\n", strerror(errno));
+    
+    switch (h->settings->output) {
+    case GM_OUTPUT_UINPUT: h->out = &gmi_output_uinput; break;
+    case GM_OUTPUT_XCB:    h->out = &gmi_output_xcb;    break;
+    default:               h->out = &gmi_output_xtest;  break;
+    }
+    gmi_worker* w = h->workers;
+    if (worker_open(w)) {
+        if (h->out != &gmi_output_xtest) {
+            fprintf(stderr, "%s output unavailable: %s\n", h->out->name, strerror(errno));
+            h->out = &gmi_output_xtest;
+        }
+        if (worker_open(w)) {
+            fprintf(stderr, "failed to find display (NULL)\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* every other worker gets its own connection to the same output */
+    for (t = 1; t < h->nworkers; ++t) {
+        if (worker_open(&h->workers[t])) {
+            fprintf(stderr, "%s output unavailable for worker %u, running %u\n", h->out->name, t, t);
+            unsigned int k;
+            for (k = t; k < h->nworkers; ++k) {
+                gmi_worker* o = &h->workers[k];
+                if (o->display) XCloseDisplay(o->display);
+                o->display = NULL;
+                if (o->tfd != -1) {
+                    close(o->tfd);
+                    close(o->efd);
+                    close(o->epfd);
+                }
+                pthread_cond_destroy(&o->chain_cond);
+            }
+            h->nworkers = t;
+            break;
+        }
+    }
 
+    h->key_table = key_table_new(63, NULL);
+    
+    h->lthread_control = true;
+    
     int ret = pthread_create(&h->thread, NULL, &listen, h);
     if (ret) {
         fprintf(stderr, "pthread_create(): %d\n", ret);
         exit(EXIT_FAILURE);
     }
-
     
-    h->lthread_control = true;
+    /* failures are reported on stderr; a missing device is opened once it appears */
+    if (devpath) gm_device_add(h, devpath);
     
-    pthread_create(&h->lthread, NULL, &gm_sched_entry, h);
+    for (t = 0; t < h->nworkers; ++t)
+        pthread_create(&h->workers[t].thread, NULL, &gm_sched_entry, &h->workers[t]);
 
     return h;
 }
 
-void gmh_sleep(gm_handle _h, int ms) {
+void gmh_sleep(gm_handle h, int ms) {
+    gmh_sleep_us(h, (long) ms * 1000L);
+}
+
+void gmh_sleep_us(gm_handle _h, long us) {
     #if DEBUG_MODE
-    printf("sleep called! (%d)\n", ms);
+    printf("sleep called! (%ldus)\n", us);
     #endif
-    gmi_handle* h = (gmi_handle*) _h;
-    h->active_handler->routine.req_sleep_time = ms;
-    h->active_handler->routine.returned = false;
-    getcontext(&h->active_handler->routine.context); /* save current context to restore into */
-    if (!h->active_handler->routine.returned) { /* flag to check if we already returned from here */
-        h->active_handler->routine.returned = true;
-        setcontext(&h->context); /* return to the point in which we last set h->context (wrapper func) */
-    }
+    gmi_worker* w = worker_self((gmi_handle*) _h);
+    gmi_routine* r = w->active_handler;
+    /* a zero delay would be mistaken for a resume, so round up to 1ns */
+    r->req_sleep_time = us > 0 ? (uint64_t) us * 1000ULL : 1;
+    /* return to the wrapper, which reschedules us (stackless handlers return themselves) */
+    if (r->stack)
+        gmi_ctx_switch(&r->context, &w->context);
 }
 
 void gmh_wait(gm_handle _h, gm_latch _l) {
     #if DEBUG_MODE
     printf("wait called! (%p)\n", _l);
     #endif
-    gmi_handle* h = (gmi_handle*) _h;
+    gmi_worker* w = worker_self((gmi_handle*) _h);
+    gmi_routine* r = w->active_handler;
     gmi_latch* l = (gmi_latch*) _l;
 
-    if (l->state == true) return;
+    pthread_spin_lock(&l->lock);
+    if (l->state == true) {
+        pthread_spin_unlock(&l->lock);
+        return;
+    }
     
     if (l->idx >= l->linksz) {
         l->linksz *= 2;
-        l->links = realloc(l->links, l->linksz);
+        l->links = realloc(l->links, l->linksz * sizeof(*l->links));
     }
     
-    l->links[l->idx] = h->active_handler;
+    l->links[l->idx] = r;
     ++l->idx;
     
-    h->active_handler->routine.waiting = true;
-    h->active_handler->routine.returned = false;
-    getcontext(&h->active_handler->routine.context); /* save context */
-    if (!h->active_handler->routine.returned) { /* check return */
-        h->active_handler->routine.returned = true;
-        setcontext(&h->context);
-    }
+    atomic_store(&r->latch, l);
+    r->waiting = true;
+    pthread_spin_unlock(&l->lock);
+    /* opening it from another worker resumes us here, which only happens once we switched out */
+    if (r->stack)
+        gmi_ctx_switch(&r->context, &w->context);
 }
 
 gm_latch gm_latch_new(void) {
     gmi_latch* l = malloc(sizeof(struct gmi_latch));
-    l->links = malloc((l->linksz = 4));
+    pthread_spin_init(&l->lock, PTHREAD_PROCESS_PRIVATE);
+    l->links = malloc((l->linksz = 4) * sizeof(*l->links));
     l->state = false;
     l->idx = 0;
     return l;
@@ -692,22 +2564,31 @@ gm_latch gm_latch_new(void) {
 
 void gm_latch_destroy(gm_latch _l) {
     gmi_latch* l = (gmi_latch*) _l;
+    pthread_spin_destroy(&l->lock);
     free(l->links);
     free(l);
 }
 
+/* waiting routines are resumed on the worker they run on */
 void gmh_latch_open(gm_handle h, gm_latch _l) {
     gmi_latch* l = (gmi_latch*) _l;
+    pthread_spin_lock(&l->lock);
     l->state = true;
     size_t t;
     for (t = 0; t < l->idx; ++t) {
-        chain_register_eventd((gmi_handle*) h, &gm_wrapper, 0, l->links[t]->routine.data);
+        gmi_routine* r = l->links[t];
+        atomic_store(&r->latch, NULL);
+        chain_register_eventd(r->worker, &gm_wrapper, 0, r);
     }
     l->idx = 0;
+    pthread_spin_unlock(&l->lock);
 }
 
 void gmh_latch_reset(gm_handle ignored, gm_latch _l) {
-    ((gmi_latch*) _l)->state = false;
+    gmi_latch* l = (gmi_latch*) _l;
+    pthread_spin_lock(&l->lock);
+    l->state = false;
+    pthread_spin_unlock(&l->lock);
 }
 
 void gm_start(gm_handle _h) {
@@ -722,50 +2603,261 @@ void gm_stop(gm_handle _h) {
 
 void gm_close(gm_handle _h) {
     gmi_handle* h = (gmi_handle*) _h;
+    unsigned int t;
     h->lthread_control = false;
-    pthread_cond_signal(&h->chain_cond); /* wakeup */
-    pthread_kill(h->thread, SIGUSR1);    /* send dummy signal to break out of read() call */
-    pthread_join(h->lthread, NULL);
+    for (t = 0; t < h->nworkers; ++t)
+        sched_wakeup(&h->workers[t]);
+    uint64_t v = 1;
+    while (write(h->lefd, &v, sizeof(v)) == -1 && errno == EINTR); /* wake the listener */
+    for (t = 0; t < h->nworkers; ++t)
+        pthread_join(h->workers[t].thread, NULL);
     pthread_join(h->thread, NULL);
-    XCloseDisplay(h->display);
+    while (h->devices) {
+        gmi_device* d = h->devices;
+        h->devices = d->next;
+        if (d->fd != -1) close(d->fd);
+        free(d);
+    }
+    if (h->ifd != -1) close(h->ifd);
+    close(h->lefd);
+    close(h->lepfd);
+    
+    for (t = 0; t < h->nworkers; ++t)
+        worker_close(&h->workers[t]);
+    free(h->workers);
+    free(h->dispatch_nodes);
+    free(h->seq.delta);
+    free(h->seq.window);
+    free(h->seq.out_first);
+    free(h->seq.out_count);
+    free(h->seq.out);
+    pool_destroy(&h->lnode_pool);
+    pool_destroy(&h->routine_pool);
+    
+    for (t = 0; t < h->keys_len; ++t)
+        free(key_at(h, (int) t)->name);
+    for (t = 0; t < GMI_KEY_CHUNKS; ++t)
+        free(h->key_chunks[t]);
+    gmi_key_table* kt = atomic_load_explicit(&h->key_table, memory_order_relaxed);
+    while (kt != NULL) {
+        gmi_key_table* prev = kt->prev;
+        free(kt);
+        kt = prev;
+    }
+}
+
+/*
+  id of an interned key name, or -1 if it is not in the table. Safe without key_lock:
+  a slot is only filled after its entry is written, and a table that is replaced meanwhile
+  only misses names interned after it, which the caller then interns under the lock.
+*/
+static int key_find(gmi_handle* h, const char* name) {
+    gmi_key_table* kt = atomic_load_explicit(&h->key_table, memory_order_acquire);
+    size_t i = gm_mapped_hash(0, name) & kt->mask;
+    int k;
+    for (; (k = atomic_load_explicit(&kt->slots[i], memory_order_acquire)) != -1; i = (i + 1) & kt->mask)
+        if (!strcmp(key_at(h, k)->name, name)) return k;
+    return -1;
+}
+
+/* id of a key name, adding it to the cache if needed (-1 if it is full). Called with key_lock held */
+static int key_intern(gmi_handle* h, const char* name) {
+    gmi_key_table* kt = atomic_load_explicit(&h->key_table, memory_order_relaxed);
+    size_t i = gm_mapped_hash(0, name) & kt->mask;
+    int k;
+    for (; (k = atomic_load_explicit(&kt->slots[i], memory_order_relaxed)) != -1; i = (i + 1) & kt->mask)
+        if (!strcmp(key_at(h, k)->name, name)) return k;
+    
+    size_t len = atomic_load_explicit(&h->keys_len, memory_order_relaxed);
+    if (len == GMI_KEY_CHUNK * GMI_KEY_CHUNKS) return -1;
+    gmi_key** chunk = &h->key_chunks[len / GMI_KEY_CHUNK];
+    if (!*chunk) *chunk = malloc(GMI_KEY_CHUNK * sizeof(gmi_key));
+    k = (int) len;
+    (*chunk)[len % GMI_KEY_CHUNK] = (gmi_key) { .name = strdup(name), .cache = 0 };
+    /* published for gmh_key_code and key_find once the entry is written */
+    atomic_store_explicit(&h->keys_len, len + 1, memory_order_release);
+    atomic_store_explicit(&kt->slots[i], k, memory_order_release);
+    
+    /* keep the table at most half full, readers may still be probing the old one */
+    if ((len + 1) * 2 > kt->mask + 1) {
+        gmi_key_table* grown = key_table_new(kt->mask * 2 + 1, kt);
+        size_t t;
+        for (t = 0; t <= len; ++t) {
+            for (i = gm_mapped_hash(0, key_at(h, (int) t)->name) & grown->mask;
+                 atomic_load_explicit(&grown->slots[i], memory_order_relaxed) != -1;
+                 i = (i + 1) & grown->mask);
+            atomic_store_explicit(&grown->slots[i], (int) t, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->key_table, grown, memory_order_release);
+    }
+    return k;
+}
+
+/*
+  output code of an interned key, resolved (on the worker's connection) if the cached
+  one is missing or stale. Workers racing on a stale entry both resolve it, and a
+  mapping change in between only makes the next call resolve it again.
+*/
+static int key_code(gmi_worker* w, int k) {
+    gmi_handle* h = w->h;
+    if (k < 0) return -1;
+    gmi_key* e = key_at(h, k);
+    unsigned int gen = atomic_load_explicit(&h->key_gen, memory_order_acquire);
+    uint64_t c = atomic_load_explicit(&e->cache, memory_order_relaxed);
+    if ((unsigned int) (c >> 32) == gen) return (int) (uint32_t) c;
+    
+    int code = h->out->resolve(w, e->name);
+    atomic_store_explicit(&e->cache, (uint64_t) gen << 32 | (uint32_t) code, memory_order_relaxed);
+    return code;
+}
+
+static void output_key(gmi_worker* w, int press, int code) {
+    if (code == -1) return;
+    w->h->out->key(w, press, code);
+    output_event(w);
+}
+
+int gm_key_resolve(gm_handle _h, const char* key) {
+    gmi_handle* h = (gmi_handle*) _h;
+    pthread_mutex_lock(&h->key_lock);
+    int k = key_intern(h, key);
+    pthread_mutex_unlock(&h->key_lock);
+    return k;
+}
+
+void gmh_key_code(gm_handle _h, int press, int key) {
+    gmi_handle* h = (gmi_handle*) _h;
+    gmi_worker* w = worker_self(h);
+    /* no lock: ids below keys_len point at entries that are already written */
+    size_t len = atomic_load_explicit(&h->keys_len, memory_order_acquire);
+    output_key(w, press, key >= 0 && (size_t) key < len ? key_code(w, key) : -1);
 }
 
 void gmh_key(gm_handle _h, int press, const char* key) {
     gmi_handle* h = (gmi_handle*) _h;
-    XTestFakeKeyEvent(h->display, X11_KEYSYM(h->display, key), press, 0);
-    if (h->flush) XFlush(h->display);
+    gmi_worker* w = worker_self(h);
+    /* only a name seen for the first time takes the lock */
+    int k = key_find(h, key);
+    if (k == -1) {
+        pthread_mutex_lock(&h->key_lock);
+        k = key_intern(h, key);
+        pthread_mutex_unlock(&h->key_lock);
+    }
+    output_key(w, press, key_code(w, k));
 }
 
 void gmh_mouse(gm_handle _h, int press, unsigned int button) {
     if (button == 0) return; /* for some reason X freaks out if we ask for button 0 */
     gmi_handle* h = (gmi_handle*) _h;
-    XTestFakeButtonEvent(h->display, button, press == 1 ? true : false, CurrentTime);
-    if (h->flush) XFlush(h->display);
+    gmi_worker* w = worker_self(h);
+    h->out->button(w, press, button);
+    output_event(w);
 }
 
 void gmh_move(gm_handle _h, int x, int y) {
     gmi_handle* h = (gmi_handle*) _h;
-    XTestFakeMotionEvent(h->display, DefaultScreen(h->display), x, y, 0);
-    if (h->flush) XFlush(h->display);
+    gmi_worker* w = worker_self(h);
+    h->out->move(w, x, y);
+    if (h->settings->pointer_track) atomic_store(&h->pointer, pointer_pack(h, x, y));
+    output_event(w);
 }
 
 void gmh_getmouse(gm_handle _h, int* x, int* y) {
     gmi_handle* h = (gmi_handle*) _h;
+    gmi_worker* w = worker_self(h);
+    long track = h->settings->pointer_track;
+    uint64_t p = 0;
+    if (track) {
+        p = atomic_load(&h->pointer);
+        if (p != POINTER_NONE && (track < 0 || gmi_now() - w->pointer_sync < (uint64_t) track * 1000000ULL)) {
+            *x = POINTER_X(p);
+            *y = POINTER_Y(p);
+            COUNT_ADD(w->pointer_tracked, 1);
+            return;
+        }
+    }
+    /* no (recent enough) data, ask for real */
+    h->out->pointer(w, x, y);
+    COUNT_ADD(w->pointer_queried, 1);
+    if (track) {
+        /*
+          only replace what we started from: EV_REL deltas the listener added (or a
+          move or SYN_DROPPED) while the query was in flight are newer than its answer
+        */
+        w->pointer_sync = gmi_now();
+        atomic_compare_exchange_strong(&h->pointer, &p, pointer_pack(h, *x, *y));
+    }
+}
+
+void gm_stats(gm_handle _h, gm_statistics* s) {
+    gmi_handle* h = (gmi_handle*) _h;
+    pool_stats(&h->lnode_pool,   &s->events);
+    pool_stats(&h->routine_pool, &s->routines);
     
-    XEvent e;
-    XQueryPointer(h->display, RootWindow(h->display, DefaultScreen(h->display)),
-                  &e.xbutton.root, &e.xbutton.window,
-                  &e.xbutton.x_root, &e.xbutton.y_root,
-                  &e.xbutton.x, &e.xbutton.y,
-                  &e.xbutton.state);
+    pthread_mutex_lock(&h->inst_lock);
+    s->policy_dropped   = h->policy_dropped;
+    s->policy_queued    = h->policy_queued;
+    s->policy_restarted = h->policy_restarted;
+    s->policy_parallel  = h->policy_parallel;
+    pthread_mutex_unlock(&h->inst_lock);
+    
+    s->stacks = (gm_pool_stats) { .used = 0, .free = 0, .peak = 0, .misses = 0 };
+    s->stack_hwm = 0;
+    s->pointer_tracked = s->pointer_queried = 0;
+    s->output_events = s->output_flushes = 0;
+    s->sched_stolen = 0;
+    
+    unsigned int t;
+    for (t = 0; t < h->nworkers; ++t) {
+        gmi_worker* w = &h->workers[t];
+        s->stacks.used   += COUNT_GET(w->stacks_used);
+        s->stacks.free   += COUNT_GET(w->stacks_free);
+        s->stacks.peak   += COUNT_GET(w->stacks_peak);
+        s->stacks.misses += COUNT_GET(w->stacks_misses);
+        if (COUNT_GET(w->stacks_hwm) > s->stack_hwm) s->stack_hwm = COUNT_GET(w->stacks_hwm);
+        
+        s->pointer_tracked += COUNT_GET(w->pointer_tracked);
+        s->pointer_queried += COUNT_GET(w->pointer_queried);
+        s->output_events   += COUNT_GET(w->output_events);
+        s->output_flushes  += COUNT_GET(w->output_flushes);
+        s->sched_stolen    += COUNT_GET(w->stolen);
+    }
+    
+    void lat(size_t off, gm_latency* l) {
+        gmi_hist_sum m = { .count = 0, .max = 0 };
+        unsigned int k;
+        for (k = 0; k < h->nworkers; ++k)
+            hist_merge(&m, (gmi_hist*) ((uint8_t*) &h->workers[k] + off));
+        hist_stats(&m, l);
+    }
+    lat(offsetof(gmi_worker, lat_kernel),   &s->lat_kernel);
+    lat(offsetof(gmi_worker, lat_listener), &s->lat_listener);
+    lat(offsetof(gmi_worker, lat_queue),    &s->lat_queue);
+    lat(offsetof(gmi_worker, lat_output),   &s->lat_output);
+    lat(offsetof(gmi_worker, lat_total),    &s->lat_total);
+    lat(offsetof(gmi_worker, lat_handler),  &s->lat_handler);
+}
 
-    *x = e.xbutton.x;
-    *y = e.xbutton.y;
+int gm_macro_stats(gm_handle _h, const gm_macro* macro, gm_macro_statistics* s) {
+    gmi_handle* h = (gmi_handle*) _h;
+    gm_macro_node* c;
+    for (c = h->macro_chain; c != NULL; c = c->next) {
+        if (c->macro == macro) {
+            pthread_mutex_lock(&h->inst_lock);
+            *s = (gm_macro_statistics) {
+                .invocations = c->stats.invocations, .dropped = c->stats.dropped,
+                .handler_ns = atomic_load_explicit(&c->stats.handler_ns, memory_order_relaxed)
+            };
+            pthread_mutex_unlock(&h->inst_lock);
+            return 0;
+        }
+    }
+    return 1;
 }
 
 void gmh_flush(gm_handle _h, int toggle) {
-    gmi_handle* h = (gmi_handle*) _h;
-    h->flush = toggle ? true : false;
+    gmi_worker* w = worker_self((gmi_handle*) _h);
+    w->flush = toggle ? true : false;
     if (toggle)
-        XFlush(h->display);
+        output_flush(w);
 }
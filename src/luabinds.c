@@ -9,29 +9,77 @@
 #include <lauxlib.h>
 
 #include <unistd.h>
-#include <ucontext.h>
+#include <pthread.h>
 #include <X11/Xlib.h>
 
 #include <gmacros.h>
+#include <context.h>
+#include <output.h>
 #include <libgmacros.h>
 
+/* the 5.3 API used below, for builds against LuaJIT (LUAJIT=true) or Lua 5.1/5.2 */
+#if LUA_VERSION_NUM < 502
+#define LUA_OK 0
+#define lua_rawlen(L, i) lua_objlen(L, i)
+/* only used with LUA_REGISTRYINDEX, which needs no index adjustment */
+#define lua_rawgetp(L, i, p) (lua_pushlightuserdata(L, (void*) (p)), lua_rawget(L, i))
+#define lua_rawsetp(L, i, p) (lua_pushlightuserdata(L, (void*) (p)), lua_insert(L, -2), lua_rawset(L, i))
+#endif
+#if LUA_VERSION_NUM < 503
+static inline int lua_isinteger(lua_State* L, int i) {
+    return lua_type(L, i) == LUA_TNUMBER && lua_tonumber(L, i) == (lua_Number) lua_tointeger(L, i);
+}
+#endif
+
 #define STATE(H) ((lua_State*) (((gmi_handle*) H)->lstate))
 
-#define LHANDLER(L)                                         \
-    ({                                                      \
-        lua_getglobal(L, "__gm_handler");                   \
-        gm_handle h = (gm_handle) lua_touserdata(L, -1);    \
-        lua_pop(L, 1);                                      \
-        h;                                                  \
-    })
+/* the coroutine mode thread being resumed, NULL while running a macro on a C stack */
+#define LCOROUTINE(H) ((lua_State*) (((gmi_handle*) H)->lcoroutine))
+
+/*
+  Lua runs on one thread at a time: the main chunk until gm.listen, then handlers on
+  whichever scheduler worker they are on. A handler on a C stack lets go while it is
+  suspended; coroutine mode macros hold it for each resume.
+*/
+#define GML_LOCK(H)   pthread_mutex_lock(&((gmi_handle*) H)->llock)
+#define GML_UNLOCK(H) pthread_mutex_unlock(&((gmi_handle*) H)->llock)
 
+/* run a call that may suspend the handler, without holding the lock on a C stack */
+#define GML_BLOCKING(H, CALL)                   \
+    do {                                        \
+        bool _held = !LCOROUTINE(H);            \
+        if (_held) GML_UNLOCK(H);               \
+        CALL;                                   \
+        if (_held) GML_LOCK(H);                 \
+    } while (0)
+
+#if LUA_VERSION_NUM >= 504
+#define GML_RESUME(L, from, n) ({ int _nres; lua_resume(L, from, n, &_nres); })
+#elif LUA_VERSION_NUM >= 502
+#define GML_RESUME(L, from, n) lua_resume(L, from, n)
+#else
+#define GML_RESUME(L, from, n) lua_resume(L, n)
+#endif
+
+/* every gm.* function shares one box holding the handle as its first upvalue, set by gm.init */
+#define LHANDLER(L) (*(gm_handle*) lua_touserdata(L, lua_upvalueindex(1)))
+
+/* set t[N] = F for the table on top of the stack, with the handle box right below it */
 #define PUSHFUNC(L, N, F)                       \
     do {                                        \
         lua_pushstring(L, N);                   \
-        lua_pushcfunction(L, F);                \
+        lua_pushvalue(L, -3);                   \
+        lua_pushcclosure(L, F, 1);              \
         lua_rawset(L, -3);                      \
     } while (0)
 
+/* set t[N] = V for the table on top of the stack */
+#define SETINT(L, N, V)                             \
+    do {                                            \
+        lua_pushinteger(L, (lua_Integer) (V));      \
+        lua_setfield(L, -2, N);                     \
+    } while (0)
+
 struct gml_settings_accessor {
     const char* key;
     void (*set)(gm_settings* s);
@@ -39,8 +87,20 @@ struct gml_settings_accessor {
 
 #define ST_F(K, ...) { .key = #K, .set = ({ void _f(gm_settings* s) __VA_ARGS__; _f; }) }
 #define ST_INT(K) ST_F(K, { s->K = lua_tointeger(L, -1); })
+#define ST_FLAG(K) ST_F(K, { s->K = lua_isboolean(L, -1) ? lua_toboolean(L, -1) : lua_tointeger(L, -1); })
+
+/* output backend names, in GM_OUTPUT_XXX order */
+static const char* gml_outputs[] = { "xtest", "uinput", "xcb", NULL };
 
-#define ST_SETTINGS_KEYS { ST_INT(sched_intval) }
+#define ST_OUTPUT(K) ST_F(K, { s->K = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : luaL_checkoption(L, -1, NULL, gml_outputs); })
+
+#define ST_SETTINGS_KEYS {                                               \
+        ST_INT(sched_intval), ST_FLAG(sched_timerfd), ST_INT(sched_workers), \
+        ST_INT(pool_size),                                                  \
+        ST_INT(stack_size), ST_INT(stack_cache), ST_FLAG(stack_debug),      \
+        ST_INT(instance_limit), ST_INT(sequence_window), ST_OUTPUT(output), \
+        ST_INT(pointer_track), ST_FLAG(output_coalesce)                     \
+    }
 
 static int gml_flush(lua_State* L) {
     gm_handle h = LHANDLER(L);
@@ -50,13 +110,44 @@ static int gml_flush(lua_State* L) {
     return 0;
 }
 
+/*
+  gm.keycode(key) -> id that gm.key and gm.sim take instead of the name, skipping its lookup.
+  Ids are light userdata (id + 1), so numbers keep meaning key names ("5").
+*/
+#define GML_KEYCODE(L, i) ((int) (intptr_t) lua_touserdata(L, i) - 1)
+
+static int gml_keycode(lua_State* L) {
+    lua_pushlightuserdata(L, (void*) (intptr_t) (gm_key_resolve(LHANDLER(L), luaL_checkstring(L, 1)) + 1));
+    return 1;
+}
+
 static int gml_key(lua_State* L) {
     gm_handle h = LHANDLER(L);
-    if (lua_isboolean(L, -2) && lua_isstring(L, -1)) {
+    if (lua_isboolean(L, -2) && lua_islightuserdata(L, -1)) {
+        gmh_key_code(h, lua_toboolean(L, -2), GML_KEYCODE(L, -1));
+    } else if (lua_isboolean(L, -2) && lua_isstring(L, -1)) {
         const char* key = lua_tostring(L, -1);
         int press = lua_toboolean(L, -2);
         gmh_key(h, press, key);
-    } else luaL_error(L, "gml_key(): expected (boolean, string)");
+    } else luaL_error(L, "gml_key(): expected (boolean, string or keycode)");
+    return 0;
+}
+
+/*
+  press and release, both go out with the same flush when output is coalesced. Names go
+  through gmh_key, whose lookup of an already seen name takes no lock
+*/
+static int gml_sim(lua_State* L) {
+    gm_handle h = LHANDLER(L);
+    if (lua_islightuserdata(L, 1)) {
+        int key = GML_KEYCODE(L, 1);
+        gmh_key_code(h, 1, key);
+        gmh_key_code(h, 0, key);
+    } else if (lua_isstring(L, 1)) {
+        const char* key = lua_tostring(L, 1);
+        gmh_key(h, 1, key);
+        gmh_key(h, 0, key);
+    } else return luaL_error(L, "gml_sim(): expected (string or keycode)");
     return 0;
 }
 
@@ -83,91 +174,278 @@ static int gml_move(lua_State* L) {
 static int gml_getmouse(lua_State* L) {
     gm_handle h = LHANDLER(L);
     int x, y;
-    gmh_getmouse(h, &x, &y);
+    GML_BLOCKING(h, gmh_getmouse(h, &x, &y)); /* the xcb output waits for the reply */
     lua_pushinteger(L, x);
     lua_pushinteger(L, y);
     return 2;
 }
 
+/*
+  In coroutine mode gmh_sleep and gmh_wait only schedule the resume, and the macro's
+  thread yields back to gml_step. It has to be that thread: yielding a coroutine the
+  macro created itself would return into Lua code instead of the scheduler.
+*/
+#define GML_CAN_SUSPEND(L, h, fname)                                                             \
+    do {                                                                                         \
+        if (LCOROUTINE(h) && LCOROUTINE(h) != L)                                                 \
+            luaL_error(L, fname "(): cannot suspend a coroutine inside a coroutine mode macro"); \
+    } while (0)
+
+/* the C stack was already switched out and back if there is no thread to yield */
+#define GML_SUSPEND(L, h) (LCOROUTINE(h) ? lua_yield(L, 0) : 0)
+
 static int gml_sleep(lua_State* L) {
     gm_handle h = LHANDLER(L);
     if (lua_isinteger(L, -1)) {
         int ms = lua_tointeger(L, -1);
         if (ms > 0) {
-            gmh_sleep(h, ms);
+            GML_CAN_SUSPEND(L, h, "gml_sleep");
+            GML_BLOCKING(h, gmh_sleep(h, ms));
         } else luaL_error(L, "gml_sleep(): expected first argument larger than 0");
     } else luaL_error(L, "gml_sleep(): expected (integer)");
+    return GML_SUSPEND(L, h);
+}
+
+static int gml_sleep_us(lua_State* L) {
+    gm_handle h = LHANDLER(L);
+    if (lua_isinteger(L, -1)) {
+        long us = lua_tointeger(L, -1);
+        if (us > 0) {
+            GML_CAN_SUSPEND(L, h, "gml_sleep_us");
+            GML_BLOCKING(h, gmh_sleep_us(h, us));
+        } else luaL_error(L, "gml_sleep_us(): expected first argument larger than 0");
+    } else luaL_error(L, "gml_sleep_us(): expected (integer)");
+    return GML_SUSPEND(L, h);
+}
+
+/*
+  Lua threads that run macro invocations, one at a time. Finished threads go on a free
+  list for the next trigger instead of to the GC, and every thread is anchored in the
+  registry by a luaL_ref for as long as the pool holds it.
+*/
+#define GML_THREADS_CACHED 64 /* free threads kept, any more are left to the GC */
+
+typedef struct gml_thread {
+    lua_State* L;
+    int ref;
+    struct gml_thread* next; /* free list */
+} gml_thread;
+
+struct gml_threads {
+    lua_State* M; /* main thread, creates threads and owns the references */
+    gml_thread* free;
+    size_t free_len;
+    unsigned long created, reused, released;
+};
+
+static const char gml_threads_key = 0; /* registry key of the struct gml_threads userdata */
+
+static gml_thread* gml_thread_get(struct gml_threads* p) {
+    gml_thread* t = p->free;
+    if (t) {
+        p->free = t->next;
+        --p->free_len;
+        ++p->reused;
+        return t;
+    }
+    t = malloc(sizeof(gml_thread));
+    t->L = lua_newthread(p->M);
+    t->ref = luaL_ref(p->M, LUA_REGISTRYINDEX);
+    ++p->created;
+    return t;
+}
+
+/* recycle a thread that finished cleanly, or let go of one that cannot run again */
+static void gml_thread_put(struct gml_threads* p, gml_thread* t, bool reusable) {
+    if (reusable && p->free_len < GML_THREADS_CACHED) {
+        lua_settop(t->L, 0);
+        t->next = p->free;
+        p->free = t;
+        ++p->free_len;
+    } else {
+        luaL_unref(p->M, LUA_REGISTRYINDEX, t->ref);
+        free(t);
+        ++p->released;
+    }
+}
+
+static int gml_threads_gc(lua_State* L) {
+    struct gml_threads* p = lua_touserdata(L, 1);
+    while (p->free) {
+        gml_thread* t = p->free;
+        p->free = t->next;
+        free(t);
+    }
     return 0;
 }
 
 struct wrapper_data {
-    lua_State* L;
+    gm_handle h;
+    struct gml_threads* threads;
     int f_idx;
     gm_macro m;
 };
 
-static void gml_wrapper(int value, void* arg) {
-    lua_State* M = ((struct wrapper_data*) arg)->L;
-    int f_idx = ((struct wrapper_data*) arg)->f_idx;
-    
-    lua_State* L = lua_newthread(M); /* create new stack */
-    int pos = lua_gettop(M);         /* position of this thread in the main stack */
-
+/* push the registered function onto L, returns false (with an empty stack) if it is gone */
+static bool gml_push_function(lua_State* L, int f_idx, const char* fname) {
     lua_getglobal(L, "__gm_reg");
     if (!lua_istable(L, -1)) {
-        printf("gml_wrapper(): __gm_reg is not a table");
-        lua_pop(L, 1);
-        return;
+        printf("%s(): __gm_reg is not a table\n", fname);
+        lua_settop(L, 0);
+        return false;
     }
     lua_rawgeti(L, -1, f_idx);
-
+    lua_remove(L, -2);
     if (!lua_isfunction(L, -1)) {
-        printf("gml_wrapper(): tried to execute function at invalid index: %d\n", f_idx);
-        lua_pop(L, 2);
-        return;
+        printf("%s(): tried to execute function at invalid index: %d\n", fname, f_idx);
+        lua_settop(L, 0);
+        return false;
     }
+    return true;
+}
 
-    lua_pushinteger(L, value);
+static void gml_wrapper(int value, void* arg) {
+    struct wrapper_data* d = (struct wrapper_data*) arg;
+    GML_LOCK(d->h);
+    gml_thread* t = gml_thread_get(d->threads); /* new stack */
+    lua_State* L = t->L;
     
-    switch (lua_pcall(L, 1, 0, 0)) {
-    case LUA_ERRRUN:
-        printf("gml_wrapper(): runtime error: %s\n", lua_tostring(L, -1));
-        lua_pop(L, 1);
-        break;
-    case LUA_ERRMEM:
-        printf("gml_wrapper(): allocation error\n");
-        break;
-    case LUA_ERRERR:
-        printf("gml_wrapper(): error while handling error\n");
-        break;
+    if (gml_push_function(L, d->f_idx, "gml_wrapper")) {
+        lua_pushinteger(L, value);
+        
+        switch (lua_pcall(L, 1, 0, 0)) {
+        case LUA_ERRRUN:
+            printf("gml_wrapper(): runtime error: %s\n", lua_tostring(L, -1));
+            break;
+        case LUA_ERRMEM:
+            printf("gml_wrapper(): allocation error\n");
+            break;
+        case LUA_ERRERR:
+            printf("gml_wrapper(): error while handling error\n");
+            break;
+        }
     }
+    
+    /* errors were caught by lua_pcall, so the thread can always run again */
+    gml_thread_put(d->threads, t, true);
+    GML_UNLOCK(d->h);
+}
 
-    lua_pop(L, 1); /* pop table */
+/*
+  gm_macro.step for coroutine mode macros: the function runs as a plain Lua coroutine,
+  gm.sleep and gm.wait yield it and the scheduler resumes it, so no C stack is involved.
+*/
+static int gml_step(int value, void* arg, void** state) {
+    struct wrapper_data* d = (struct wrapper_data*) arg;
+    gml_thread* t = *state;
+    gmi_handle* h = (gmi_handle*) d->h;
+    int nargs = 0;
     
-    /*
-      Since we can break execution in the middle of this wrapper and have
-      new threads pushed onto the main stack, we kept track of the stack
-      position of our thread object. We need to replace it with nil (so
-      the stack doesn't overflow and it can be collected), and then
-      cleanup the stack without shifting the positions of other threads
-    */
+    GML_LOCK(h);
+    if (t == NULL) {
+        *state = t = gml_thread_get(d->threads);
+        if (!gml_push_function(t->L, d->f_idx, "gml_step")) {
+            gml_thread_put(d->threads, t, true);
+            GML_UNLOCK(h);
+            return 0;
+        }
+        lua_pushinteger(t->L, value);
+        nargs = 1;
+    }
     
-    lua_pushnil(M);
-    lua_replace(M, pos); /* remove thread from main stack */
+    h->lcoroutine = t->L;
+    int ret = GML_RESUME(t->L, d->threads->M, nargs);
+    h->lcoroutine = NULL;
     
-    /* walk through stack and remove all nils before an active thread */
-    int t, a = 0;
-    for (t = lua_gettop(M); t >= 1; --t) {
-        if (lua_isnil(M, t)) ++a;
-        else break;
+    switch (ret) {
+    case LUA_YIELD:
+        lua_settop(t->L, 0);
+        GML_UNLOCK(h);
+        return 1;
+    case LUA_OK:
+        break;
+    case LUA_ERRMEM:
+        printf("gml_step(): allocation error\n");
+        break;
+    default:
+        printf("gml_step(): runtime error: %s\n", lua_tostring(t->L, -1));
+        break;
     }
-    if (a) lua_pop(M, a);
+    /* a coroutine that raised an error is dead */
+    gml_thread_put(d->threads, t, ret == LUA_OK);
+    GML_UNLOCK(h);
+    return 0;
 }
 
+/* a restarted coroutine is suspended mid-yield and cannot be reused */
+static void gml_discard(void* arg, void* state) {
+    struct wrapper_data* d = (struct wrapper_data*) arg;
+    if (!state) return;
+    GML_LOCK(d->h);
+    gml_thread_put(d->threads, state, false);
+    GML_UNLOCK(d->h);
+}
+
+/*
+  gm.sequence objects are a boxed gm_sequence, freed when Lua collects the box. gm.register
+  keeps it in __gm_reg, and the library keeps it alive for invocations still running it.
+*/
+static const char gml_sequence_key = 0; /* registry key of the sequence metatable */
+
+static int gml_sequence_gc(lua_State* L) {
+    gm_sequence* s = lua_touserdata(L, 1);
+    if (*s) gm_sequence_free(*s);
+    *s = NULL;
+    return 0;
+}
+
+/* the compiled sequence at index i (> 0), NULL for anything else */
+static gm_sequence gml_tosequence(lua_State* L, int i) {
+    gm_sequence* s = lua_touserdata(L, i);
+    if (s == NULL || !lua_getmetatable(L, i)) return NULL;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &gml_sequence_key);
+    bool is = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return is ? *s : NULL;
+}
+
+/* invocation policy names accepted by gm.register */
+static const char* gml_policies[] = { "drop", "queue", "restart", "parallel", NULL };
+
 static int gml_register(lua_State* L) {
     gm_handle h = LHANDLER(L);
-    if (lua_isstring(L, -2) && lua_isfunction(L, -1)) {
-        const char* lkey = lua_tostring(L, -2);
+    gm_sequence seq = gml_tosequence(L, 2);
+    if (lua_isstring(L, 1) && (lua_isfunction(L, 2) || seq)
+        && (lua_isnoneornil(L, 3) || lua_istable(L, 3))) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &gml_threads_key);
+        struct gml_threads* threads = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        const char* lkey = lua_tostring(L, 1);
+        int policy = GM_POLICY_DROP;
+        unsigned int limit = 0;
+        bool coroutine = false;
+        
+        if (lua_istable(L, 3)) {
+            lua_getfield(L, 3, "policy");
+            policy = luaL_checkoption(L, -1, "drop", gml_policies);
+            lua_getfield(L, 3, "limit");
+            limit = (unsigned int) luaL_optinteger(L, -1, 0);
+            /*
+              a restarted handler on a C stack would be abandoned inside lua_pcall, with
+              its Lua thread never returned, so restart runs in coroutine mode
+            */
+            lua_getfield(L, 3, "coroutine");
+            coroutine = lua_isnil(L, -1) ? policy == GM_POLICY_RESTART : lua_toboolean(L, -1);
+            if (policy == GM_POLICY_RESTART && !coroutine && !seq)
+                luaL_error(L, "gml_register(): policy \"restart\" needs coroutine mode");
+            lua_getfield(L, 3, "device");
+            if (!lua_isnil(L, -1) && !lua_isstring(L, -1))
+                luaL_error(L, "gml_register(): device must be a string");
+            lua_replace(L, 3); /* key, f, device */
+        }
+        lua_settop(L, 3);
+        size_t dsz;
+        const char* ldev = lua_isstring(L, 3) ? lua_tolstring(L, 3, &dsz) : NULL;
         
         lua_getglobal(L, "__gm_idx");
         if (!lua_isnumber(L, -1)) {
@@ -181,14 +459,14 @@ static int gml_register(lua_State* L) {
 
         /* f, idx, table */
         
-        lua_pushvalue(L, -3); /* copy function to top (f, idx, table, f)*/
+        lua_pushvalue(L, 2); /* copy function (or sequence) to top (f, device, idx, table, f)*/
         lua_rawseti(L, -2, idx);
         
         lua_pushinteger(L, idx + 1);
         lua_setglobal(L, "__gm_idx");
         
         size_t sz = strlen(lkey);
-        struct wrapper_data* d = lua_newuserdata(L, sizeof(struct wrapper_data) + sz + 1);
+        struct wrapper_data* d = lua_newuserdata(L, sizeof(struct wrapper_data) + sz + 1 + (ldev ? dsz + 1 : 0));
 
         lua_rawseti(L, -2, -idx); /* push userdata to negative index */
         
@@ -201,29 +479,247 @@ static int gml_register(lua_State* L) {
                 key[t] -= 0x20;
         }
         
+        char* device = NULL;
+        if (ldev) {
+            device = key + sz + 1;
+            memcpy(device, ldev, dsz + 1);
+        }
+        
         *d = (struct wrapper_data) {
-            .L = L, .f_idx = idx, .m = {
-                .arg = d, .f = &gml_wrapper, .key = key
+            .h = h, .threads = threads, .f_idx = idx, .m = {
+                .arg = d, .f = seq || coroutine ? NULL : &gml_wrapper, .key = key, .policy = policy,
+                .limit = limit, .device = device, .sequence = seq
             }
         };
+        if (coroutine && !seq) {
+            d->m.step = &gml_step;
+            d->m.discard = &gml_discard;
+        }
 
         if (gm_register(h, &d->m)) {
             luaL_error(L, "gml_register(): invalid key string \"%s\"", key);
         }
         
-    } else luaL_error(L, "gml_register(): expected (string, function)");
+    } else luaL_error(L, "gml_register(): expected (string, function or sequence, [optional] table)");
     
     return 0;
 }
 
+/*
+  gm.sequence{ {"sim", "x"}, {"click", 1}, {"sleep", 20}, ... } compiles a list of steps,
+  named like the functions (and examples/dota.lua helpers) they stand for:
+    {"key", press, key}   {"mouse", press, button}   {"move", x, y}
+    {"sim", key}          {"click", button}          {"target", button, x, y}
+    {"sleep", ms}         {"sleep_us", us}          (numbers, ms may have a fraction)
+*/
+static const char* gml_steps[] = { "key", "mouse", "move", "sim", "click", "target", "sleep", "sleep_us", NULL };
+
+/*
+  key name of a step at absolute index i. A number is only converted on the stack, so the
+  string is kept in the 'anchors' table until the steps are compiled.
+*/
+static const char* gml_step_key(lua_State* L, int i, int anchors) {
+    bool number = lua_type(L, i) == LUA_TNUMBER;
+    const char* key = lua_tostring(L, i);
+    if (number) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, anchors, (int) lua_rawlen(L, anchors) + 1);
+    }
+    return key;
+}
+
+/* numeric argument of step t at absolute index i */
+static lua_Number gml_step_number(lua_State* L, int i, size_t t) {
+    if (!lua_isnumber(L, i))
+        luaL_error(L, "gml_sequence(): step %d expects a number", (int) t);
+    return lua_tonumber(L, i);
+}
+
+static int gml_sequence(lua_State* L) {
+    gm_handle h = LHANDLER(L);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t n = lua_rawlen(L, 1), t, c = 0;
+    /* "target" takes four steps; collected by Lua if a step is rejected */
+    gm_step* steps = lua_newuserdata(L, (n ? n : 1) * 4 * sizeof(gm_step));
+    gm_sequence* box = lua_newuserdata(L, sizeof(gm_sequence)); /* the result */
+    *box = NULL;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &gml_sequence_key);
+    lua_setmetatable(L, -2);
+    lua_newtable(L); /* converted key names */
+    
+    for (t = 1; t <= n; ++t) {
+        lua_rawgeti(L, 1, (lua_Integer) t);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "gml_sequence(): step %d is not a table", (int) t);
+        int i;
+        for (i = 1; i <= 4; ++i) lua_rawgeti(L, -i, i); /* step, name, a, b, c */
+        int top = lua_gettop(L);
+        int op = luaL_checkoption(L, top - 3, NULL, gml_steps);
+        #define A gml_step_number(L, top - 2, t)
+        #define B gml_step_number(L, top - 1, t)
+        #define D gml_step_number(L, top, t)
+        switch (op) {
+        case 0: /* key */
+            steps[c++] = (gm_step) { .op = GM_STEP_KEY, .press = lua_toboolean(L, top - 2), .key = gml_step_key(L, top - 1, 4) };
+            break;
+        case 1: /* mouse */
+            steps[c++] = (gm_step) { .op = GM_STEP_BUTTON, .press = lua_toboolean(L, top - 2), .button = (unsigned int) B };
+            break;
+        case 2: /* move */
+            steps[c++] = (gm_step) { .op = GM_STEP_MOVE, .x = (int) A, .y = (int) B };
+            break;
+        case 3: /* sim */
+            steps[c++] = (gm_step) { .op = GM_STEP_KEY, .press = 2, .key = gml_step_key(L, top - 2, 4) };
+            break;
+        case 4: /* click */
+            steps[c++] = (gm_step) { .op = GM_STEP_BUTTON, .press = 2, .button = (unsigned int) A };
+            break;
+        case 5: /* target */
+            steps[c++] = (gm_step) { .op = GM_STEP_SAVE };
+            steps[c++] = (gm_step) { .op = GM_STEP_MOVE, .x = (int) B, .y = (int) D };
+            steps[c++] = (gm_step) { .op = GM_STEP_BUTTON, .press = 2, .button = (unsigned int) A };
+            steps[c++] = (gm_step) { .op = GM_STEP_RESTORE };
+            break;
+        case 6: /* sleep */
+            steps[c++] = (gm_step) { .op = GM_STEP_SLEEP, .us = (long) (A * 1000.0) }; /* 16.6 ms is fine */
+            break;
+        case 7: /* sleep_us */
+            steps[c++] = (gm_step) { .op = GM_STEP_SLEEP, .us = (long) A };
+            break;
+        }
+        #undef A
+        #undef B
+        #undef D
+        /* key names stay referenced by the step tables (or the anchors) until compiled */
+        if ((op == 0 || op == 3) && !steps[c - 1].key)
+            luaL_error(L, "gml_sequence(): step %d has no key", (int) t);
+        lua_settop(L, 4);
+    }
+    
+    if (!(*box = gm_sequence_compile(h, steps, c))) luaL_error(L, "gml_sequence(): invalid step");
+    lua_pop(L, 1); /* the key names, returning the box */
+    return 1;
+}
+
+static int gml_run(lua_State* L) {
+    gm_sequence s = gml_tosequence(L, 1);
+    if (s) {
+        gm_sequence_run(LHANDLER(L), s);
+    } else luaL_error(L, "gml_run(): expected (sequence)");
+    return 0;
+}
+
+/* gm.handle() -> the handle as light userdata, for the gmh_* functions through the LuaJIT FFI */
+static int gml_handle(lua_State* L) {
+    lua_pushlightuserdata(L, LHANDLER(L));
+    return 1;
+}
+
+static int gml_device_add(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    int ret = gm_device_add(LHANDLER(L), path);
+    if (ret == 2) luaL_error(L, "gml_device_add(): failed to open \"%s\"", path);
+    lua_pushboolean(L, ret == 0); /* false if it was already added */
+    return 1;
+}
+
+static int gml_device_remove(lua_State* L) {
+    lua_pushboolean(L, !gm_device_remove(LHANDLER(L), luaL_checkstring(L, 1)));
+    return 1;
+}
+
+static void gml_push_pool(lua_State* L, const char* name, const gm_pool_stats* p) {
+    lua_newtable(L);
+    SETINT(L, "used", p->used);
+    SETINT(L, "free", p->free);
+    SETINT(L, "peak", p->peak);
+    SETINT(L, "misses", p->misses);
+    lua_setfield(L, -2, name);
+}
+
+static void gml_push_latency(lua_State* L, const char* name, const gm_latency* l) {
+    lua_newtable(L);
+    SETINT(L, "count", l->count);
+    SETINT(L, "p50", l->p50);
+    SETINT(L, "p99", l->p99);
+    SETINT(L, "max", l->max);
+    lua_setfield(L, -2, name);
+}
+
+/* gm.stats() -> table of counters, latencies in nanoseconds, and per macro counters in registration order */
+static int gml_stats(lua_State* L) {
+    gm_handle h = LHANDLER(L);
+    gm_statistics s;
+    gm_stats(h, &s);
+    
+    lua_newtable(L);
+    gml_push_pool(L, "events", &s.events);
+    gml_push_pool(L, "routines", &s.routines);
+    gml_push_pool(L, "stacks", &s.stacks);
+    SETINT(L, "stack_hwm", s.stack_hwm);
+    SETINT(L, "policy_dropped", s.policy_dropped);
+    SETINT(L, "policy_queued", s.policy_queued);
+    SETINT(L, "policy_restarted", s.policy_restarted);
+    SETINT(L, "policy_parallel", s.policy_parallel);
+    SETINT(L, "pointer_tracked", s.pointer_tracked);
+    SETINT(L, "pointer_queried", s.pointer_queried);
+    SETINT(L, "output_events", s.output_events);
+    SETINT(L, "output_flushes", s.output_flushes);
+    SETINT(L, "sched_stolen", s.sched_stolen);
+    
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &gml_threads_key);
+    struct gml_threads* p = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    lua_newtable(L);
+    SETINT(L, "used", p->created - p->released - p->free_len);
+    SETINT(L, "free", p->free_len);
+    SETINT(L, "created", p->created);
+    SETINT(L, "reused", p->reused);
+    SETINT(L, "released", p->released); /* handed to the GC */
+    lua_setfield(L, -2, "lua_threads");
+    SETINT(L, "lua_memory", (lua_Integer) lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+    gml_push_latency(L, "lat_kernel", &s.lat_kernel);
+    gml_push_latency(L, "lat_listener", &s.lat_listener);
+    gml_push_latency(L, "lat_queue", &s.lat_queue);
+    gml_push_latency(L, "lat_output", &s.lat_output);
+    gml_push_latency(L, "lat_total", &s.lat_total);
+    gml_push_latency(L, "lat_handler", &s.lat_handler);
+    
+    lua_newtable(L);
+    lua_getglobal(L, "__gm_idx");
+    int n = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : 0;
+    lua_getglobal(L, "__gm_reg");
+    if (lua_istable(L, -1)) {
+        int t, i = 1;
+        for (t = 1; t < n; ++t) {
+            lua_rawgeti(L, -1, -t); /* wrapper data is stored at negative indices */
+            struct wrapper_data* d = lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            gm_macro_statistics ms;
+            if (d == NULL || gm_macro_stats(h, &d->m, &ms)) continue;
+            lua_newtable(L);
+            lua_pushstring(L, d->m.key);
+            lua_setfield(L, -2, "key");
+            SETINT(L, "invocations", ms.invocations);
+            SETINT(L, "dropped", ms.dropped);
+            SETINT(L, "handler_ns", ms.handler_ns);
+            lua_rawseti(L, -4, i++); /* macros, idx, reg, entry */
+        }
+    }
+    lua_pop(L, 2);
+    lua_setfield(L, -2, "macros");
+    return 1;
+}
+
 static int gml_reset(lua_State* L) {
     
     gm_handle h = LHANDLER(L);
-    gm_unregister_all(h);
+    if (gm_unregister_all(h))
+        luaL_error(L, "gml_reset(): macros are still listening or running");
     
     lua_newtable(L);
     lua_setglobal(L, "__gm_reg");
-    lua_pushinteger(L, 0);
+    lua_pushinteger(L, 1); /* index 0 would put the function and its wrapper data in the same slot */
     lua_setglobal(L, "__gm_idx");
     return 0;
 }
@@ -259,9 +755,12 @@ static int gml_latch_reset(lua_State* L) {
 static int gml_wait(lua_State* L) {
     gm_handle h = LHANDLER(L);
     if (lua_islightuserdata(L, 1)) {
-        gmh_wait(h, lua_touserdata(L, 1));
+        gmi_latch* l = lua_touserdata(L, 1);
+        if (l->state) return 0; /* already open, nothing will resume us */
+        GML_CAN_SUSPEND(L, h, "gml_wait");
+        GML_BLOCKING(h, gmh_wait(h, l));
     } else luaL_error(L, "gml_wait(): expected (latch)");
-    return 0;
+    return GML_SUSPEND(L, h);
 }
 
 static int gml_listen(lua_State* L) {
@@ -275,7 +774,9 @@ static int gml_listen(lua_State* L) {
     gm_handle h = LHANDLER(L);
     gm_start(h);
 
+    GML_UNLOCK(h);
     pause();
+    GML_LOCK(h);
 
     gm_stop(h);
     
@@ -283,8 +784,8 @@ static int gml_listen(lua_State* L) {
 }
 
 static int gml_init(lua_State* L) {
-    if (!lua_isstring(L, 1))
-        luaL_error(L, "gml_init(): expected (string, [optional] table)");
+    if (!lua_isstring(L, 1) && !lua_isnil(L, 1))
+        luaL_error(L, "gml_init(): expected (string or nil, [optional] table)");
     
     const gm_settings* settings = &gm_default_settings; 
     
@@ -292,12 +793,14 @@ static int gml_init(lua_State* L) {
         struct gml_settings_accessor settings_keys[] = ST_SETTINGS_KEYS;
         
         gm_settings* c = malloc(sizeof(gm_settings));
+        *c = gm_default_settings; /* keys missing from the table keep their defaults */
         size_t t;
         for (t = 0; t < sizeof(settings_keys) / sizeof(struct gml_settings_accessor); ++t) {
             struct gml_settings_accessor* a = &settings_keys[t];
             lua_pushstring(L, a->key);
             lua_rawget(L, 2);
-            a->set(c);
+            if (!lua_isnil(L, -1))
+                a->set(c);
             #if DEBUG_MODE
             printf("lua set settings->%s = \"%s\"\n", a->key, lua_tostring(L, -1));
             #endif
@@ -307,13 +810,15 @@ static int gml_init(lua_State* L) {
         settings = c;
     }
 
-    gm_handle* h = gm_init(lua_tostring(L, 1), settings);
+    gm_handle* h = gm_init(lua_isstring(L, 1) ? lua_tostring(L, 1) : NULL, settings);
     if (h == NULL) {
         luaL_error(L, "gml_init(): failed to initialize library (check device permissions?)");
     }
     
     ((gmi_handle*) h)->lstate = L; /* store in handler */
+    GML_LOCK(h); /* the main chunk runs Lua until gm.listen */
     
+    LHANDLER(L) = h;
     lua_pushlightuserdata(L, h);
     lua_setglobal(L, "__gm_handler");
     
@@ -324,23 +829,50 @@ __attribute__((visibility("default"))) int gm_lua(lua_State* L) {
     
     lua_newtable(L);
     lua_setglobal(L, "__gm_reg");
+    
+    struct gml_threads* threads = lua_newuserdata(L, sizeof(struct gml_threads));
+    #if LUA_VERSION_NUM < 502
+    lua_pushthread(L); /* scripts load the library from their main chunk */
+    #else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    #endif
+    *threads = (struct gml_threads) { .M = lua_tothread(L, -1) };
+    lua_pop(L, 1);
+    lua_newtable(L);
+    PUSHFUNC(L, "__gc", &gml_threads_gc);
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &gml_threads_key);
+    
+    lua_newtable(L);
+    PUSHFUNC(L, "__gc", &gml_sequence_gc);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &gml_sequence_key);
 
     lua_pushinteger(L, 1);
     lua_setglobal(L, "__gm_idx");
     
+    *(gm_handle*) lua_newuserdata(L, sizeof(gm_handle)) = NULL; /* the box, filled by gm.init */
     lua_newtable(L);
     PUSHFUNC(L, "key", &gml_key);
+    PUSHFUNC(L, "keycode", &gml_keycode);
+    PUSHFUNC(L, "sim", &gml_sim);
     PUSHFUNC(L, "mouse", &gml_mouse);
     PUSHFUNC(L, "move", &gml_move);
     PUSHFUNC(L, "getmouse", &gml_getmouse);
     PUSHFUNC(L, "sleep", &gml_sleep);
+    PUSHFUNC(L, "sleep_us", &gml_sleep_us);
     PUSHFUNC(L, "wait", &gml_wait);
     PUSHFUNC(L, "flush", &gml_flush);
     
     PUSHFUNC(L, "register", &gml_register);
+    PUSHFUNC(L, "sequence", &gml_sequence);
+    PUSHFUNC(L, "run", &gml_run);
     PUSHFUNC(L, "reset", &gml_reset);
     PUSHFUNC(L, "init", &gml_init);
+    PUSHFUNC(L, "handle", &gml_handle);
     PUSHFUNC(L, "listen", &gml_listen);
+    PUSHFUNC(L, "device_add", &gml_device_add);
+    PUSHFUNC(L, "stats", &gml_stats);
+    PUSHFUNC(L, "device_remove", &gml_device_remove);
     
     PUSHFUNC(L, "latch_new", &gml_latch_new);
     PUSHFUNC(L, "latch_destroy", &gml_latch_destroy);
@@ -348,6 +880,7 @@ __attribute__((visibility("default"))) int gm_lua(lua_State* L) {
     PUSHFUNC(L, "latch_reset", &gml_latch_reset);
     
     lua_setglobal(L, "gm");
+    lua_pop(L, 1); /* box */
     
     return 0;
 }
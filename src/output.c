@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XTest.h>
+
+#include <linux/uinput.h>
+
+#if GM_XCB
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h> /* xcb_poll_for_reply */
+#include <xcb/xtest.h>
+#include <xcb/xcb_keysyms.h>
+#endif
+
+#include <gmacros.h>
+
+#include <context.h>
+#include <output.h>
+#include <libgmacros.h>
+
+@ {
+    #include <linux/input.h>
+
+    struct gmi_worker;
+    struct xcb_connection_t;
+    struct _XCBKeySymbols;
+
+    /* output backend, selected with gm_settings.output. Every scheduler worker opens its own connection */
+    typedef struct {
+        const char* name;
+        bool xlib; /* wants w->display opened */
+        /* returns non-zero if unavailable, sets the pointer range and w->xfd (-1 for none) */
+        int  (*open)    (struct gmi_worker* w);
+        void (*close)   (struct gmi_worker* w);
+        /*
+          handle events from the connection in w->xfd, read: also read from the socket
+          rather than only looking at what was already queued. Returns non-zero if the
+          keyboard mapping changed.
+        */
+        int  (*events)  (struct gmi_worker* w, int read);
+        int  (*resolve) (struct gmi_worker* w, const char* key); /* key code for a name, -1 if none */
+        void (*key)     (struct gmi_worker* w, int press, int code);
+        void (*button)  (struct gmi_worker* w, int press, unsigned int button);
+        void (*move)    (struct gmi_worker* w, int x, int y);
+        void (*pointer) (struct gmi_worker* w, int* x, int* y);
+        void (*flush)   (struct gmi_worker* w);
+    } gmi_output;
+
+    /* uinput backend state, events are queued until the next flush */
+    typedef struct {
+        int fd;
+        struct input_event* buf;
+        size_t len, cap;
+        int x, y; /* last position moved to */
+    } gmi_uinput;
+
+    /* XCB backend state, it has its own connection and never touches Xlib's */
+    typedef struct {
+        struct xcb_connection_t* c;
+        struct _XCBKeySymbols* syms;
+        unsigned int root;
+        unsigned int seq;  /* QueryPointer request in flight */
+        bool pending;
+        gm_latch reply;    /* opened when that reply is in   */
+        int x, y;          /* position from the last reply   */
+    } gmi_xcb;
+
+    extern const gmi_output gmi_output_xtest;
+    extern const gmi_output gmi_output_uinput;
+    extern const gmi_output gmi_output_xcb;
+}
+
+/* XTest: every event is a request on the X connection, flushing writes the socket */
+
+#define X11_KEYSYM(D, S) ((unsigned int) XKeysymToKeycode(D, XStringToKeysym(S)))
+
+static int xtest_open(gmi_worker* w) {
+    if (!w->display) {
+        errno = ECONNREFUSED;
+        return 1;
+    }
+    w->h->pointer_w = DisplayWidth(w->display, DefaultScreen(w->display));
+    w->h->pointer_h = DisplayHeight(w->display, DefaultScreen(w->display));
+    w->xfd = ConnectionNumber(w->display);
+    return 0;
+}
+
+/* the X server sends MappingNotify to every client, unasked */
+static int xlib_events(gmi_worker* w, int read) {
+    int changed = 0;
+    if (!w->display || !XEventsQueued(w->display, read ? QueuedAfterReading : QueuedAlready)) return 0;
+    XEvent e;
+    while (XEventsQueued(w->display, QueuedAlready)) {
+        XNextEvent(w->display, &e);
+        if (e.type == MappingNotify && e.xmapping.request != MappingPointer) {
+            XRefreshKeyboardMapping(&e.xmapping);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static void xtest_close(gmi_worker* w) {}
+
+static int xtest_resolve(gmi_worker* w, const char* key) {
+    unsigned int code = X11_KEYSYM(w->display, key);
+    return code ? (int) code : -1;
+}
+
+static void xtest_key(gmi_worker* w, int press, int code) {
+    XTestFakeKeyEvent(w->display, (unsigned int) code, press, 0);
+}
+
+static void xtest_button(gmi_worker* w, int press, unsigned int button) {
+    XTestFakeButtonEvent(w->display, button, press == 1 ? true : false, CurrentTime);
+}
+
+static void xtest_move(gmi_worker* w, int x, int y) {
+    XTestFakeMotionEvent(w->display, DefaultScreen(w->display), x, y, 0);
+}
+
+static void xtest_pointer(gmi_worker* w, int* x, int* y) {
+    XEvent e;
+    XQueryPointer(w->display, RootWindow(w->display, DefaultScreen(w->display)),
+                  &e.xbutton.root, &e.xbutton.window,
+                  &e.xbutton.x_root, &e.xbutton.y_root,
+                  &e.xbutton.x, &e.xbutton.y,
+                  &e.xbutton.state);
+
+    *x = e.xbutton.x;
+    *y = e.xbutton.y;
+}
+
+static void xtest_flush(gmi_worker* w) {
+    XFlush(w->display);
+}
+
+const gmi_output gmi_output_xtest = {
+    .name = "xtest", .xlib = true, .open = &xtest_open, .close = &xtest_close, .events = &xlib_events, .resolve = &xtest_resolve, .key = &xtest_key,
+    .button = &xtest_button, .move = &xtest_move, .pointer = &xtest_pointer, .flush = &xtest_flush
+};
+
+/*
+  uinput: a virtual keyboard and absolute pointer. Events are queued with a SYN_REPORT
+  after each one and written with a single write() per flush. Works without X (the
+  pointer range then is 0 - 65535 instead of the X screen size).
+*/
+
+static void uinput_emit(gmi_uinput* u, unsigned short type, unsigned short code, int value) {
+    if (u->len == u->cap) {
+        u->cap *= 2;
+        u->buf = realloc(u->buf, u->cap * sizeof(*u->buf));
+    }
+    u->buf[u->len++] = (struct input_event) { .type = type, .code = code, .value = value };
+}
+
+static int uinput_open(gmi_worker* w) {
+    gmi_uinput* u = &w->uinput;
+    unsigned int t;
+
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return 1;
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    /* keyboard keys and mouse buttons, leaving out the joystick and gamepad ranges */
+    for (t = KEY_ESC; t < BTN_MISC; ++t) ioctl(fd, UI_SET_KEYBIT, t);
+    for (t = BTN_LEFT; t <= BTN_TASK; ++t) ioctl(fd, UI_SET_KEYBIT, t);
+    for (t = KEY_OK; t < BTN_DPAD_UP; ++t) ioctl(fd, UI_SET_KEYBIT, t);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+    ioctl(fd, UI_SET_ABSBIT, ABS_X);
+    ioctl(fd, UI_SET_ABSBIT, ABS_Y);
+
+    int wd = w->display ? DisplayWidth(w->display, DefaultScreen(w->display)) : 65536;
+    int ht = w->display ? DisplayHeight(w->display, DefaultScreen(w->display)) : 65536;
+    struct uinput_abs_setup ax = { .code = ABS_X, .absinfo = { .minimum = 0, .maximum = wd - 1 } };
+    struct uinput_abs_setup ay = { .code = ABS_Y, .absinfo = { .minimum = 0, .maximum = ht - 1 } };
+    struct uinput_setup us = { .id = { .bustype = BUS_VIRTUAL, .vendor = 0x1, .product = 0x1 } };
+    strncpy(us.name, "gmacros", UINPUT_MAX_NAME_SIZE - 1);
+
+    if (ioctl(fd, UI_ABS_SETUP, &ax) || ioctl(fd, UI_ABS_SETUP, &ay)
+        || ioctl(fd, UI_DEV_SETUP, &us) || ioctl(fd, UI_DEV_CREATE)) {
+        close(fd);
+        return 1;
+    }
+
+    *u = (gmi_uinput) { .fd = fd, .buf = malloc(64 * sizeof(*u->buf)), .len = 0, .cap = 64, .x = 0, .y = 0 };
+    w->h->pointer_w = wd;
+    w->h->pointer_h = ht;
+    w->xfd = w->display ? ConnectionNumber(w->display) : -1;
+    return 0;
+}
+
+static void uinput_close(gmi_worker* w) {
+    gmi_uinput* u = &w->uinput;
+    ioctl(u->fd, UI_DEV_DESTROY);
+    close(u->fd);
+    free(u->buf);
+}
+
+static int uinput_resolve(gmi_worker* w, const char* key) {
+    int code = gmi_key_code(key);
+    #if DEBUG_MODE
+    if (code == -1) printf("uinput: no evdev code for key '%s'\n", key);
+    #endif
+    return code;
+}
+
+static void uinput_key(gmi_worker* w, int press, int code) {
+    uinput_emit(&w->uinput, EV_KEY, (unsigned short) code, press ? 1 : 0);
+    uinput_emit(&w->uinput, EV_SYN, SYN_REPORT, 0);
+}
+
+/* X button numbers: 1-3 left, middle, right; 4-7 wheel up, down, left, right; 8-9 back, forward */
+static void uinput_button(gmi_worker* w, int press, unsigned int button) {
+    static const unsigned short buttons[] = { 0, BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, 0, 0, 0, 0, BTN_SIDE, BTN_EXTRA };
+    gmi_uinput* u = &w->uinput;
+
+    if (button >= 4 && button <= 7) {
+        /* wheel clicks have no release */
+        if (!press) return;
+        uinput_emit(u, EV_REL, button <= 5 ? REL_WHEEL : REL_HWHEEL, button == 4 || button == 7 ? 1 : -1);
+    } else if (button < sizeof(buttons) / sizeof(*buttons)) {
+        uinput_emit(u, EV_KEY, buttons[button], press ? 1 : 0);
+    } else return;
+    uinput_emit(u, EV_SYN, SYN_REPORT, 0);
+}
+
+static void uinput_move(gmi_worker* w, int x, int y) {
+    gmi_uinput* u = &w->uinput;
+    uinput_emit(u, EV_ABS, ABS_X, x);
+    uinput_emit(u, EV_ABS, ABS_Y, y);
+    uinput_emit(u, EV_SYN, SYN_REPORT, 0);
+    u->x = x;
+    u->y = y;
+}
+
+static void uinput_pointer(gmi_worker* w, int* x, int* y) {
+    if (w->display) {
+        xtest_pointer(w, x, y);
+    } else {
+        *x = w->uinput.x;
+        *y = w->uinput.y;
+    }
+}
+
+static void uinput_flush(gmi_worker* w) {
+    gmi_uinput* u = &w->uinput;
+    const char* p = (const char*) u->buf;
+    size_t left = u->len * sizeof(*u->buf);
+    while (left) {
+        ssize_t n = write(u->fd, p, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "uinput write(): %s\n", strerror(errno));
+            break;
+        }
+        p += n;
+        left -= (size_t) n;
+    }
+    u->len = 0;
+}
+
+const gmi_output gmi_output_uinput = {
+    .name = "uinput", .xlib = true, .open = &uinput_open, .close = &uinput_close, .events = &xlib_events, .resolve = &uinput_resolve, .key = &uinput_key,
+    .button = &uinput_button, .move = &uinput_move, .pointer = &uinput_pointer, .flush = &uinput_flush
+};
+
+/*
+  XCB: XTest requests on a separate connection. Nothing waits on the server except
+  resolving a key for the first time after a mapping change. gmh_getmouse sends the
+  query and waits on a latch (so other handlers keep running) that xcbtest_events opens
+  once the reply has been read from w->xfd.
+*/
+
+#if GM_XCB
+
+static int xcbtest_open(gmi_worker* w) {
+    gmi_xcb* u = &w->xcb;
+    int screen;
+    xcb_connection_t* c = xcb_connect(NULL, &screen);
+    /* xcb does not set errno, gm_init reports it */
+    if (xcb_connection_has_error(c)) {
+        xcb_disconnect(c);
+        errno = ECONNREFUSED;
+        return 1;
+    }
+    const xcb_query_extension_reply_t* ext = xcb_get_extension_data(c, &xcb_test_id);
+    if (!ext || !ext->present) {
+        xcb_disconnect(c);
+        errno = ENOTSUP;
+        return 1;
+    }
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(c));
+    for (; screen > 0 && it.rem; --screen) xcb_screen_next(&it);
+    
+    *u = (gmi_xcb) {
+        .c = c, .syms = xcb_key_symbols_alloc(c), .root = it.data->root,
+        .seq = 0, .pending = false, .reply = gm_latch_new(), .x = 0, .y = 0
+    };
+    /* load the keyboard mapping here rather than on the first key a handler sends */
+    free(xcb_key_symbols_get_keycode(u->syms, XStringToKeysym("a")));
+    
+    w->h->pointer_w = it.data->width_in_pixels;
+    w->h->pointer_h = it.data->height_in_pixels;
+    w->xfd = xcb_get_file_descriptor(c);
+    return 0;
+}
+
+static void xcbtest_close(gmi_worker* w) {
+    gmi_xcb* u = &w->xcb;
+    xcb_key_symbols_free(u->syms);
+    xcb_disconnect(u->c);
+    gm_latch_destroy(u->reply);
+}
+
+/* take the pointer query reply if it is there (or wait for it), returns 1 if it was */
+static int xcbtest_pointer_reply(gmi_worker* w, bool block) {
+    gmi_xcb* u = &w->xcb;
+    xcb_query_pointer_reply_t* r = NULL;
+    if (!u->pending) return 0;
+    if (block) r = xcb_query_pointer_reply(u->c, (xcb_query_pointer_cookie_t) { u->seq }, NULL);
+    else if (!xcb_poll_for_reply(u->c, u->seq, (void**) &r, NULL)) return 0;
+    u->pending = false;
+    if (r) {
+        u->x = r->root_x;
+        u->y = r->root_y;
+        free(r);
+    }
+    return 1;
+}
+
+static int xcbtest_events(gmi_worker* w, int read) {
+    gmi_xcb* u = &w->xcb;
+    xcb_generic_event_t* e;
+    int changed = 0;
+    while ((e = read ? xcb_poll_for_event(u->c) : xcb_poll_for_queued_event(u->c))) {
+        if ((e->response_type & ~0x80) == XCB_MAPPING_NOTIFY
+            && xcb_refresh_keyboard_mapping(u->syms, (xcb_mapping_notify_event_t*) e) == 1)
+            changed = 1;
+        free(e);
+    }
+    if (xcbtest_pointer_reply(w, false)) gmh_latch_open(w->h, u->reply);
+    return changed;
+}
+
+static int xcbtest_resolve(gmi_worker* w, const char* key) {
+    KeySym sym = XStringToKeysym(key); /* a table lookup, no connection involved */
+    if (sym == NoSymbol) return -1;
+    xcb_keycode_t* codes = xcb_key_symbols_get_keycode(w->xcb.syms, (xcb_keysym_t) sym);
+    int code = codes && codes[0] != XCB_NO_SYMBOL ? codes[0] : -1;
+    free(codes);
+    return code;
+}
+
+static void xcbtest_key(gmi_worker* w, int press, int code) {
+    xcb_test_fake_input(w->xcb.c, press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, (uint8_t) code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+static void xcbtest_button(gmi_worker* w, int press, unsigned int button) {
+    xcb_test_fake_input(w->xcb.c, press == 1 ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE, (uint8_t) button, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+static void xcbtest_move(gmi_worker* w, int x, int y) {
+    xcb_test_fake_input(w->xcb.c, XCB_MOTION_NOTIFY, 0, XCB_CURRENT_TIME, w->xcb.root, (int16_t) x, (int16_t) y, 0);
+}
+
+static void xcbtest_pointer(gmi_worker* w, int* x, int* y) {
+    gmi_xcb* u = &w->xcb;
+    if (!u->pending) {
+        u->seq = xcb_query_pointer(u->c, u->root).sequence;
+        u->pending = true;
+        gmh_latch_reset(w->h, u->reply);
+        xcb_flush(u->c);
+    }
+    /* without the epoll scheduler nothing watches the connection, and stackless handlers
+       cannot wait, so just block */
+    if (w->xfd != -1 && w->active_handler && w->active_handler->stack) gmh_wait(w->h, u->reply);
+    xcbtest_pointer_reply(w, true);
+    *x = u->x;
+    *y = u->y;
+}
+
+static void xcbtest_flush(gmi_worker* w) {
+    xcb_flush(w->xcb.c);
+}
+
+const gmi_output gmi_output_xcb = {
+    .name = "xcb", .xlib = false, .open = &xcbtest_open, .close = &xcbtest_close, .events = &xcbtest_events, .resolve = &xcbtest_resolve,
+    .key = &xcbtest_key, .button = &xcbtest_button, .move = &xcbtest_move, .pointer = &xcbtest_pointer, .flush = &xcbtest_flush
+};
+
+#else
+
+/* built without XCB (see the XCB option in build.lua) */
+static int xcbtest_open(gmi_worker* w) {
+    errno = ENOSYS;
+    return 1;
+}
+
+const gmi_output gmi_output_xcb = { .name = "xcb", .xlib = false, .open = &xcbtest_open };
+
+#endif